@@ -2,74 +2,796 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define TRUE 1
 #define FALSE 0
 
-/* Create a structure that would represent an account */
-typedef struct _Account
+/* Tokens on an input line are separated by spaces, line endings are stripped off */
+#define DELIMITERS " \t\r\n"
+
+/* A transaction section smaller than this per thread is not worth splitting further */
+#define MIN_CHUNK_BYTES 65536
+
+/* The running narrative is only printed when not in quiet mode */
+#define LOG(...) do { if(verbose) printf(__VA_ARGS__); } while(0)
+
+/* Scheduler priority classes, a lower number is served first within a round */
+#define CLASS_INTERACTIVE 0
+#define CLASS_BULK 1
+#define CLASS_MAINTENANCE 2
+#define NUM_CLASSES 3
+
+/* End of day maintenance operations run over every account */
+#define BATCH_MONTHLY_FEES 0
+#define BATCH_INTEREST 1
+#define BATCH_RESET_COUNTERS 2
+#define BATCH_OVERDRAFT_SWEEP 3
+#define BATCH_WITHDRAWAL 4
+#define MAX_BATCH_OPERATIONS 16
+
+/* Index value used for "no such account" */
+#define ACCOUNT_NONE 0xFFFFFFFFu
+
+/* Account flag bits */
+#define ACCOUNT_OVERDRAFT_PROTECTED 0x01
+#define ACCOUNT_CLOSED 0x02
+
+/* Marks a name number that is still local to the parser chunk that first saw the name */
+#define LATE_NAME 0x80000000u
+
+/* Accounts are stored in blocks holding the columns of this many accounts */
+#define ACCOUNTS_PER_BLOCK 256
+
+/* Spin budget of an account lock, in pause instructions, before the waiter parks */
+#define MIN_SPIN_LIMIT 16
+#define MAX_SPIN_LIMIT 8192
+#define INITIAL_SPIN_LIMIT 256
+#define MAX_SPIN_BACKOFF 64
+
+/* Fee schedules are referred to by a 16-bit index */
+#define MAX_FEE_SCHEDULES 65536
+
+/* Jobs are encoded in blocks of at most this many, behind a header of three 16 bit sizes */
+#define JOBS_PER_BLOCK 128
+#define JOB_BLOCK_HEADER 6
+
+/* Room a block can take at most, every varint of a job is at most 5 bytes */
+#define MAX_JOB_BLOCK_BYTES (JOB_BLOCK_HEADER + JOBS_PER_BLOCK / 2 + JOBS_PER_BLOCK * 15)
+
+/* The paged store prefetches this many jobs ahead in each of up to so many running transactions */
+#define PREFETCH_DISTANCE 16
+#define MAX_PREFETCH_TRANSACTIONS 1024
+
+/* Hardware and software counters read around each phase with -P */
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_L1_MISSES 2
+#define PERF_LLC_MISSES 3
+#define PERF_CONTEXT_SWITCHES 4
+#define NUM_PERF_COUNTERS 5
+
+/* A pending deposits word holds the sum of the deposits in its high 40 bits and their count
+in the low 24. It is added into the block well before either can overflow */
+#define DEPOSIT_COUNT_BITS 24
+#define DEPOSIT_COUNT_MASK ((1u << DEPOSIT_COUNT_BITS) - 1)
+#define MAX_PENDING_DEPOSITS (1u << 23)
+#define MAX_PENDING_SUM ((int64_t) 1 << 38)
+
+/* Shard processes with -N, each pair of them and the router talk over rings of this many messages */
+#define MAX_SHARDS 16
+#define SHARD_RING_SIZE 1024
+
+/* Kinds of shard messages. A job comes from the router, a cross shard transfer is prepared
+on the receiver's shard once the sender's shard has reserved the funds, and is then
+committed or aborted on the sender's shard */
+#define SHARD_JOB 0
+#define SHARD_PREPARE 1
+#define SHARD_COMMIT 2
+#define SHARD_ABORT 3
+#define SHARD_BARRIER 4
+#define SHARD_STOP 5
+
+/* Counters each thread keeps for the metrics exporter with -M */
+#define METRIC_JOBS_APPLIED 0
+#define METRIC_JOBS_REJECTED 1
+#define METRIC_WITHDRAWALS_REJECTED 2
+#define METRIC_TRANSFERS_REJECTED 3
+#define METRIC_FEES 4
+#define METRIC_TRANSACTIONS 5
+#define METRIC_BUSY_NS 6
+#define NUM_METRICS 7
+
+/* The exporter wakes this often to look for a scrape or the end of the run */
+#define METRICS_TICK_MS 50
+
+/* Holds every interned string (IDs and type names), strings are referred to by their offset in here */
+typedef struct _StringPool
+{
+	char *data;
+	unsigned int size;
+	unsigned int capacity;
+} StringPool;
+
+/* Fees of an account type, shared by every account with the same type and fees */
+typedef struct _FeeSchedule
 {
-	char id[5];
-	char type[10];
+	/* Offset of the type name in the string pool */
+	unsigned int type;
 	int depositFee;
 	int withdrawalFee;
 	int transferFee;
 	int transactionFee;
 	int transactionFeeThreshold;
-	int isOverdraftProtected;
 	int overdraftFee;
-	int balance;
-	int numTransactions;
+	int monthlyFee;
 	
-	/* Pointer to a next account (it's a linked list) */
-	struct _Account *next;
-	
-	/* Each account will be protected by a mutex */
-	pthread_mutex_t lock;
-} Account;
+	/* Overdraft Y or N, kept apart from the fee as protected types may charge nothing */
+	int overdraftProtected;
+} FeeSchedule;
+
+/* Holds the distinct fee schedules */
+typedef struct _FeeSchedulesList
+{
+	FeeSchedule *schedules;
+	unsigned int numSchedules;
+	unsigned int capacity;
+} FeeSchedulesList;
+
+/* Account state is kept column by column inside blocks, so bulk passes over all
+accounts run over plain arrays while one account still stays within one block */
+typedef struct _AccountBlock
+{
+	int64_t balances[ACCOUNTS_PER_BLOCK];
+	int numTransactions[ACCOUNTS_PER_BLOCK];
+	unsigned short feeSchedules[ACCOUNTS_PER_BLOCK];
+	unsigned char flags[ACCOUNTS_PER_BLOCK];
+} AccountBlock;
+
+/* An account lock that spins before it parks on a futex. State is 0 when free, 1 when
+held and 2 when held with waiters parked. The spin limit follows how long past waits took */
+typedef struct _AccountLock
+{
+	uint32_t state;
+	uint32_t spinLimit;
+} AccountLock;
 
-/* Holds the list of accounts */
+/* Holds the accounts, an account's slot is its index in here. Slots above the loaded
+accounts are reserved for accounts opened while the transactions run.
+The cold ID offsets and the locks are kept apart from the blocks */
 typedef struct _AccountsList
 {
-	Account *head;
-	Account *tail;
-	int numAccounts;
+	AccountBlock *blocks;
+	unsigned int *ids;
+	
+	/* Each account will be protected by a lock, the pthread mutexes are only
+	allocated when asked for to compare against */
+	AccountLock *locks;
+	pthread_mutex_t *mutexes;
+	
+	unsigned int numAccounts;
+	unsigned int capacity;
 } AccountsList;
 
-/* A job represents a deposit, withdraw, or fundtransfer */
+/* A job represents a deposit, withdraw, fundtransfer, or the opening or closing of an account.
+Accounts are referred to by name number, an opening job keeps the fee schedule in amount */
 typedef struct _Job
 {
 	char type;
-	Account *fromAccount;
-	Account *toAccount;
+	unsigned int fromAccount;
+	unsigned int toAccount;
 	int amount;
-		
-	/* POinter to the next job */
-	struct _Job *next;	
 } Job;
 
+/* A unit of work handed to the scheduler */
+typedef struct _WorkItem
+{
+	void (*run)(void *arg);
+	void *arg;
+	double enqueueTime;
+	
+	/* Pointer to the next item in the same queue */
+	struct _WorkItem *next;
+} WorkItem;
+
 /* Create a structure that holds a thread */
 typedef struct _Transaction
 {
 	pthread_t thread;
-	char id[10];
-	Job *jobsHead;
-	Job *jobsTail;
 	
-	/* Pointer to the next transaction (it's a linked list */
-	struct _Transaction *next;
+	/* Used instead of the thread when running on the scheduler */
+	WorkItem work;
+	
+	/* Points into the input buffer, which outlives the transactions */
+	char *id;
+	
+	/* Position of the transaction line in the input file */
+	int order;
+	
+	/* The jobs live in the job array of the chunk that parsed this transaction */
+	Job *jobs;
+	int numJobs;
+	int firstJob;
+	
+	/* Number of the first job counting over the whole input, used by the trace */
+	unsigned int jobBase;
+	
+	/* The jobs encoded in blocks when jobs are kept compact, jobs is NULL then */
+	unsigned char *encodedJobs;
+	
+	/* The job running now and the end of the jobs prefetched for, used by the paged store */
+	unsigned int progress;
+	unsigned int prefetched;
 } Transaction;
 
-/* Holds the list of transactions */
+/* Holds the list of transactions (in input file order) */
 typedef struct _TransactionsList
 {
 	Transaction *transactions;
 	int numTransactions;
+	unsigned int numJobs;
+	
+	/* Job arrays filled by the parser chunks, released at exit */
+	Job **jobArrays;
+	int numJobArrays;
+	
+	/* Every encoded job block, when the job arrays have been encoded */
+	unsigned char *encodedJobs;
+	size_t encodedSize;
 } TransactionsList;
 
+/* Walks the jobs of a transaction, holding the decoded block when the jobs are encoded */
+typedef struct _JobCursor
+{
+	Transaction *transaction;
+	const unsigned char *nextBlock;
+	unsigned int block;
+	Job jobs[JOBS_PER_BLOCK];
+} JobCursor;
+
+/* Read-only hash index from ID to account index, built once the account section is loaded */
+typedef struct _AccountIndex
+{
+	unsigned int *slots;
+	unsigned int capacity;
+} AccountIndex;
+
+/* Open addressing table from a name to its number, numbers count up from 0 in the order
+the names are added. The names are not copied */
+typedef struct _NameTable
+{
+	unsigned int *slots;
+	const char **names;
+	unsigned int numNames;
+	unsigned int capacity;
+} NameTable;
+
+/* A slice of the transaction section that is parsed by its own thread */
+typedef struct _ParseChunk
+{
+	pthread_t thread;
+	char *start;
+	char *end;
+	
+	Transaction *transactions;
+	int numTransactions;
+	int transactionsCapacity;
+	
+	Job *jobs;
+	int numJobs;
+	int jobsCapacity;
+	
+	/* Account IDs the account section doesn't have, numbered within the chunk */
+	NameTable lateNames;
+	unsigned int numOpenJobs;
+	unsigned int numCloseJobs;
+} ParseChunk;
+
+/* A FIFO queue of one priority class */
+typedef struct _WorkQueue
+{
+	const char *name;
+	WorkItem *head;
+	WorkItem *tail;
+	int length;
+	
+	/* Items this class may take per round, and how many it has left */
+	int weight;
+	int credits;
+	
+	/* Queueing delay of every item taken off this queue, in seconds */
+	double *delays;
+	int numDelays;
+	int delaysCapacity;
+} WorkQueue;
+
+/* A pool of workers serving the class queues with weighted round robin */
+typedef struct _Scheduler
+{
+	pthread_mutex_t lock;
+	pthread_cond_t workAvailable;
+	pthread_cond_t idle;
+	WorkQueue queues[NUM_CLASSES];
+	int currentClass;
+	int outstanding;
+	int shutdown;
+	pthread_t *workers;
+	int numWorkers;
+} Scheduler;
+
+/* A maintenance operation and its parameter */
+typedef struct _BatchOperation
+{
+	int operation;
+	int64_t parameter;
+} BatchOperation;
+
+/* Withdrawals from different accounts priced and applied together, one lane each. The
+balances and counts are updated in place, the fees charged and whether each withdrawal
+was taken come out in the last two columns */
+typedef struct _WithdrawalBatch
+{
+	int64_t *balances;
+	int *numTransactions;
+	const unsigned short *feeSchedules;
+	const unsigned char *flags;
+	const int *amounts;
+	int *fees;
+	unsigned char *accepted;
+	unsigned int count;
+} WithdrawalBatch;
+
+/* A range of account blocks handled by one worker during a maintenance operation */
+typedef struct _BatchPartition
+{
+	pthread_t thread;
+	WorkItem work;
+	const BatchOperation *operation;
+	unsigned int firstBlock;
+	unsigned int endBlock;
+} BatchPartition;
+
+/* An account changed since the last checkpoint and the balance it had before that */
+typedef struct _DirtyEntry
+{
+	unsigned int index;
+	int64_t before;
+} DirtyEntry;
+
+/* Tracks the accounts changed since the last checkpoint. The bitmap makes sure each
+account is only listed once, the list keeps the report proportional to the changes */
+typedef struct _DirtyTracker
+{
+	uint64_t *bits;
+	DirtyEntry *entries;
+	unsigned int numEntries;
+	unsigned int capacity;
+	pthread_mutex_t lock;
+	int enabled;
+} DirtyTracker;
+
+/* Trace of one job: its place in the global order of lock acquisitions and how long
+it waited for and held its account lock(s), times are in nanoseconds */
+typedef struct _TraceRecord
+{
+	uint64_t sequence;
+	uint64_t acquireTime;
+	uint32_t waitTime;
+	uint32_t holdTime;
+} TraceRecord;
+
+/* Header of a trace file, it is followed by one record per job in input order */
+typedef struct _TraceHeader
+{
+	char magic[8];
+	uint32_t numAccounts;
+	uint32_t numTransactions;
+	uint64_t numJobs;
+} TraceHeader;
+
+/* Recorder state, records are indexed by job number so recording never contends */
+typedef struct _Tracer
+{
+	TraceRecord *records;
+	uint64_t sequence;
+	uint64_t startTime;
+	int enabled;
+} Tracer;
+
+/* State of a replay, jobs are handed out in trace order and each one waits for the
+jobs before it on the same accounts */
+typedef struct _Replay
+{
+	unsigned int *order;
+	unsigned int *jobTransaction;
+	unsigned int *fromPosition;
+	unsigned int *toPosition;
+	unsigned int *applied;
+	unsigned int next;
+} Replay;
+
+/* A closed account slot and the epoch it was closed in */
+typedef struct _RetiredSlot
+{
+	unsigned int index;
+	uint64_t epoch;
+} RetiredSlot;
+
+/* Maps account names to the slots holding them, while accounts are opened and closed.
+Every ID in the input gets a name number once at parse time and jobs refer to accounts
+by it. Finding a slot is a single atomic load, opens and closes publish with a CAS */
+typedef struct _AccountDirectory
+{
+	unsigned int *slots;
+	unsigned int *names;
+	unsigned int numNames;
+	
+	/* IDs first seen in the transaction section, they are numbered after the loaded accounts */
+	NameTable lateNames;
+	
+	/* Slots for every opening job are reserved before the jobs run */
+	unsigned int numOpenJobs;
+	unsigned int numCloseJobs;
+	
+	/* Closed slots wait on the retired list until no job can still hold them, and are then
+	handed out again from the free list. Both lists are changed under the lock */
+	pthread_mutex_t lock;
+	RetiredSlot *retired;
+	unsigned int numRetired;
+	unsigned int *freeSlots;
+	unsigned int numFree;
+	
+	unsigned int numOpened;
+	unsigned int numClosed;
+	unsigned int numReused;
+	unsigned int numRejected;
+} AccountDirectory;
+
+/* Epoch announced by a thread, the epoch shifted left with the low bit set while the
+thread runs a job and 0 otherwise. A record is taken over by a new thread once its
+thread has exited */
+typedef struct _EpochRecord
+{
+	uint64_t state;
+	int inUse;
+	struct _EpochRecord *next;
+} EpochRecord;
+
+/* Epoch based reclamation of closed slots. A slot closed in epoch e can be reused once
+the epoch reaches e + 2, every job that could have found it has finished by then */
+typedef struct _Epochs
+{
+	uint64_t epoch;
+	EpochRecord *records;
+	pthread_key_t key;
+	int enabled;
+} Epochs;
+
+/* Funds taken off a balance ahead of the rest of an operation, with the fees they were priced at */
+typedef struct _Reservation
+{
+	unsigned int index;
+	AccountBlock *block;
+	FeeSchedule *schedule;
+	int64_t before;
+	int amount;
+	int fees;
+	int numTransactions;
+	int transactionFee;
+	int overdraftFee;
+	
+	/* Whether the balance went into debt, protected types may charge nothing for it */
+	int overdrafted;
+} Reservation;
+
+/* Withdrawals and transfers take their funds with a compare-and-swap debit with -A, instead
+of under the account locks. The debit is final once the swap goes through, a transfer only
+gives it back when its receiver turns out to be closed. Closing accounts still needs the
+locks around every balance change, so inputs with closes keep them */
+typedef struct _Reservations
+{
+	int enabled;
+	unsigned int numRejected;
+	unsigned int numReleased;
+	unsigned int numRetries;
+} Reservations;
+
+/* Depositors deposit with -D through a word per account, with a single fetch-add and no
+lock. Whoever takes the account lock adds the word into the block first, so the locked
+operations see every deposit made before them. A deposit can't be ordered against a close
+that way, so inputs with closes keep the locked deposits */
+typedef struct _PendingDeposits
+{
+	uint64_t *words;
+	int enabled;
+} PendingDeposits;
+
+/* Money the account operations of a thread moved in and out of the accounts. Forfeited
+is what a sender in overdraft paid without the receiver being credited. The shards book
+their jobs from it, so their ledgers hold what was charged and not what the balances say */
+typedef struct _JobCharges
+{
+	int64_t deposited;
+	int64_t withdrawn;
+	int64_t paidOut;
+	int64_t fees;
+	int64_t forfeited;
+} JobCharges;
+
+/* Counters of one thread. Only that thread writes them and each record has its cache lines
+to itself, so counting never waits on another thread. A record is taken over by a new
+thread once its thread has exited and the counts carry on from where they were */
+typedef struct _MetricsRecord
+{
+	uint64_t counts[NUM_METRICS];
+	int inUse;
+	struct _MetricsRecord *next;
+} __attribute__((aligned(64))) MetricsRecord;
+
+/* Live counters with -M, written to a file that is replaced by a rename every period, or
+served on a Unix socket that answers every connection with the values of the moment. The
+exporter only reads the records, the threads counting into them never see it */
+typedef struct _Metrics
+{
+	MetricsRecord *records;
+	pthread_key_t key;
+	int enabled;
+	const char *path;
+	int listenFd;
+	unsigned int periodMs;
+	unsigned int numWorkers;
+	pthread_t exporter;
+	int stopExporting;
+	int watchQueues;
+	unsigned int numExports;
+	double lastTime;
+	uint64_t lastBusy;
+} Metrics;
+
+/* A page cache frame, holding one account block of the store file */
+typedef struct _PageFrame
+{
+	AccountBlock *block;
+	unsigned int blockNumber;
+	unsigned int pinCount;
+	
+	/* Set on every use and cleared as the clock hand passes, dirty frames are written
+	back before they are reused, loading frames are being read or written back */
+	unsigned char referenced;
+	unsigned char dirty;
+	unsigned char loading;
+} PageFrame;
+
+/* Cache activity, a miss is a block a job had to wait for and a prefetch one brought in ahead of the jobs */
+typedef struct _PageCounts
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t prefetches;
+	uint64_t reads;
+	uint64_t writes;
+} PageCounts;
+
+/* Out of core account store. The account blocks live in a file and only a bounded number
+of them are in memory at a time, evicted with the CLOCK algorithm. Only the blocks are
+paged, the IDs, the string pool, the name index, the directory and the locks stay in
+memory, so the accounts still cost some bytes each outside the cache */
+typedef struct _PagedStore
+{
+	int fd;
+	PageFrame *frames;
+	AccountBlock *memory;
+	unsigned int numFrames;
+	unsigned int hand;
+	
+	/* Frame of every block, ACCOUNT_NONE when the block is only in the file */
+	unsigned int *pageTable;
+	unsigned int numBlocks;
+	
+	/* The lock covers the frames and the page table, the condition is signalled when a
+	frame finishes loading or is unpinned */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned int numWaiting;
+	
+	/* The prefetcher follows the running transactions, a few jobs ahead of each */
+	pthread_t prefetcher;
+	Transaction *running[MAX_PREFETCH_TRANSACTIONS];
+	int stopPrefetching;
+	
+	/* Counts since the start, and over the execution of the jobs alone */
+	PageCounts counts;
+	PageCounts executeCounts;
+	int enabled;
+} PagedStore;
+
+/* Counter values at one point in time, scaled for the time a counter was multiplexed out */
+typedef struct _PerfSample
+{
+	uint64_t values[NUM_PERF_COUNTERS];
+} PerfSample;
+
+/* Counts of a phase, the difference between the samples taken around it */
+typedef struct _PerfPhase
+{
+	const char *name;
+	PerfSample start;
+	PerfSample counts;
+	int used;
+} PerfPhase;
+
+/* Counter file descriptors, -1 for a counter this machine or kernel doesn't give us */
+typedef struct _PerfCounters
+{
+	int fds[NUM_PERF_COUNTERS];
+	int numOpen;
+} PerfCounters;
+
+/* A message on a shard ring */
+typedef struct _ShardMessage
+{
+	unsigned char kind;
+	
+	/* Whether a prepared transfer credits the receiver, it doesn't when the sender went into overdraft */
+	unsigned char credit;
+	unsigned short shard;
+	unsigned int transaction;
+	
+	/* Number of the job in its transaction */
+	unsigned int position;
+	unsigned int reservation;
+	Job job;
+} ShardMessage;
+
+/* A single producer, single consumer ring in the shared mapping. The consumer only
+writes head and the producer only writes tail, they are kept on lines of their own */
+typedef struct _ShardRing
+{
+	uint32_t head;
+	char headPad[60];
+	uint32_t tail;
+	char tailPad[60];
+	ShardMessage messages[SHARD_RING_SIZE];
+} ShardRing;
+
+/* Money that went in and out of the accounts of a shard, and what its jobs did */
+typedef struct _ShardLedger
+{
+	int64_t deposited;
+	int64_t withdrawn;
+	int64_t paidOut;
+	int64_t fees;
+	int64_t forfeited;
+	int64_t sent;
+	int64_t received;
+	unsigned int numJobs;
+	unsigned int numCrossTransfers;
+	unsigned int numAborted;
+	unsigned int numOpened;
+	unsigned int numClosed;
+	unsigned int numReused;
+	unsigned int numRejected;
+	int done;
+} ShardLedger;
+
+/* The state of an account when its shard finished, by name */
+typedef struct _ShardResult
+{
+	int64_t balance;
+	int numTransactions;
+	unsigned short feeSchedule;
+	unsigned char flags;
+	unsigned char open;
+} ShardResult;
+
+/* The start of the mapping shared by the router and the shards, the rings and the
+results follow it */
+typedef struct _ShardShared
+{
+	/* Messages between shards sent and not yet handled */
+	uint64_t inFlight;
+	char inFlightPad[56];
+	uint32_t numAtBarrier;
+	uint32_t numStopped;
+	ShardLedger ledgers[MAX_SHARDS];
+} ShardShared;
+
+/* Funds taken from a sender while its cross shard transfer is prepared */
+typedef struct _ShardReservation
+{
+	unsigned int name;
+	unsigned int index;
+	int amount;
+	int fees;
+	int forfeited;
+} ShardReservation;
+
+/* Messages a shard couldn't put on a full ring yet, sent in order before anything newer */
+typedef struct _ShardOutbox
+{
+	ShardMessage *messages;
+	unsigned int first;
+	unsigned int count;
+	unsigned int capacity;
+} ShardOutbox;
+
+/* Runs the jobs on -N processes, each owning the accounts whose name number is its shard
+number modulo the number of shards. The parent routes the jobs and merges the results */
+typedef struct _ShardSet
+{
+	int numShards;
+	ShardShared *shared;
+	ShardRing *rings;
+	ShardResult *results;
+	size_t size;
+	
+	/* State of the shard running in this process */
+	int self;
+	ShardLedger ledger;
+	ShardOutbox outboxes[MAX_SHARDS];
+	ShardReservation *reservations;
+	unsigned int *freeReservations;
+	unsigned int numReservations;
+	unsigned int numFreeReservations;
+	unsigned int reservationsCapacity;
+	JobCursor cursor;
+} ShardSet;
+
 /* Global variables */
+StringPool stringPool;
+FeeSchedulesList feeSchedulesList;
 AccountsList accountsList;
+AccountIndex accountIndex;
 TransactionsList transactionsList;
+Scheduler scheduler;
+DirtyTracker dirtyTracker;
+Tracer tracer;
+Replay replay;
+AccountDirectory directory;
+Epochs epochs;
+Reservations reservations;
+PendingDeposits pendingDeposits;
+PagedStore pagedStore;
+PerfCounters perfCounters;
+ShardSet shards;
+Metrics metrics;
+
+/* Trace record of the job the current thread is running, NULL when not recording */
+__thread TraceRecord *currentTraceRecord = NULL;
+
+/* Epoch record of the current thread, taken on its first job */
+__thread EpochRecord *currentEpochRecord = NULL;
+
+/* Metrics record of the current thread, taken the first time it counts something */
+__thread MetricsRecord *currentMetricsRecord = NULL;
+
+/* Charges of the account operations run on the current thread */
+__thread JobCharges currentJobCharges;
+
+/* Per fee schedule values gathered for the maintenance passes */
+int64_t *batchMonthlyFees;
+int64_t *batchOverdraftFees;
+int verbose = TRUE;
+int usePthreadLocks = FALSE;
+int useAvx2 = FALSE;
 int numDepositorsRunning = 0;
 int numDepositorsFinished = 0;
 
@@ -83,570 +805,5634 @@ pthread_mutex_t transferFundsLock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t clientsLock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t clientsWait = PTHREAD_COND_INITIALIZER;
 
-/* Create an account object of the details and adds it to the accounts list */
-void addAccount(char *line)
+/* Monotonic clock in seconds, used for the phase timings */
+double now()
 {
-	Account *account;
-	char *token;
+	struct timespec ts;
 	
-	account = (Account *) malloc(sizeof(Account));
-	account->next = NULL;
-	account->balance = 0;
-	account->numTransactions = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 	
-	pthread_mutex_init(&account->lock, NULL);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy a string into the pool and return its offset */
+unsigned int internString(StringPool *pool, const char *string)
+{
+	unsigned int offset;
+	unsigned int length;
 	
-	/* First token will always be the ID */
-	token = strtok(line, " ");
-	strcpy(account->id, token);
+	length = strlen(string) + 1;
 	
-	token = strtok(NULL, " ");
-	while(token != NULL)
+	if(pool->size + length > pool->capacity)
 	{
-		if(strcmp(token, "type") == 0)
+		while(pool->size + length > pool->capacity)
+			pool->capacity = pool->capacity == 0 ? 4096 : pool->capacity * 2;
+			
+		pool->data = (char *) realloc(pool->data, pool->capacity);
+	}
+	
+	offset = pool->size;
+	memcpy(pool->data + offset, string, length);
+	pool->size += length;
+	
+	return offset;
+}
+
+/* Job types in the order of their codes in an encoded block */
+const char jobTypeCodes[] = "dwtox";
+
+/* Signed to unsigned so that small negative numbers stay small */
+static inline uint64_t zigzag(int64_t value)
+{
+	return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+/* Undo zigzag */
+static inline int64_t unzigzag(uint64_t value)
+{
+	return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+/* Append a varint, 7 bits per byte with the high bit set on all bytes but the last */
+unsigned char *putVarint(unsigned char *out, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		*out++ = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	
+	*out++ = (unsigned char) value;
+	
+	return out;
+}
+
+/* Decode a column of varints. When the next eight bytes have no high bit set they are
+eight values of a byte each, which the loop takes a word at a time */
+const unsigned char *getVarints(const unsigned char *in, uint64_t *values, unsigned int count)
+{
+	uint64_t word;
+	uint64_t value;
+	unsigned int i;
+	int shift;
+	int j;
+	
+	i = 0;
+	
+	while(i < count)
+	{
+		if(i + 8 <= count)
 		{
-			/* Extract the account type */
-			token = strtok(NULL, " ");
-			strcpy(account->type, token);
+			memcpy(&word, in, sizeof(word));
+			
+			if((word & 0x8080808080808080ull) == 0)
+			{
+				for(j = 0; j < 8; j++)
+					values[i + j] = in[j];
+					
+				in += 8;
+				i += 8;
+				continue;
+			}
 		}
-		else if(strcmp(token, "d") == 0)
+		
+		value = 0;
+		shift = 0;
+		
+		while(*in & 0x80)
 		{
-			/* Extract the deposit fee */
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &account->depositFee);
+			value |= (uint64_t) (*in++ & 0x7F) << shift;
+			shift += 7;
 		}
-		else if(strcmp(token, "w") == 0)
+		
+		values[i++] = value | (uint64_t) *in++ << shift;
+	}
+	
+	return in;
+}
+
+/* Size of the encoded block at in */
+unsigned int jobBlockSize(const unsigned char *in)
+{
+	unsigned int count;
+	
+	count = in[0] | in[1] << 8;
+	
+	return JOB_BLOCK_HEADER + (count + 1) / 2 + (in[2] | in[3] << 8) + (in[4] | in[5] << 8);
+}
+
+/* Encode up to JOBS_PER_BLOCK jobs, returns the size of the block. The header holds the
+number of jobs and the sizes of the two varint columns. The type codes come first, two to
+a byte, then the accounts as the zigzag difference from the account before them (a
+transfer has both its accounts in there), then the amounts */
+unsigned int encodeJobBlock(const Job *jobs, unsigned int count, unsigned char *out)
+{
+	unsigned char *types;
+	unsigned char *start;
+	unsigned char *end;
+	unsigned int accountBytes;
+	unsigned int previous;
+	unsigned int i;
+	
+	types = out + JOB_BLOCK_HEADER;
+	memset(types, 0, (count + 1) / 2);
+	
+	for(i = 0; i < count; i++)
+		types[i / 2] |= (unsigned char) ((strchr(jobTypeCodes, jobs[i].type) - jobTypeCodes) << (i % 2 * 4));
+		
+	start = types + (count + 1) / 2;
+	end = start;
+	previous = 0;
+	
+	for(i = 0; i < count; i++)
+	{
+		end = putVarint(end, zigzag((int64_t) jobs[i].fromAccount - previous));
+		previous = jobs[i].fromAccount;
+		
+		if(jobs[i].type == 't')
 		{
-			/* Extract the withdrawal fee */
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &account->withdrawalFee);
+			end = putVarint(end, zigzag((int64_t) jobs[i].toAccount - previous));
+			previous = jobs[i].toAccount;
 		}
-		else if(strcmp(token, "t") == 0)
+	}
+	
+	accountBytes = end - start;
+	start = end;
+	
+	for(i = 0; i < count; i++)
+		end = putVarint(end, zigzag(jobs[i].amount));
+		
+	out[0] = (unsigned char) count;
+	out[1] = (unsigned char) (count >> 8);
+	out[2] = (unsigned char) accountBytes;
+	out[3] = (unsigned char) (accountBytes >> 8);
+	out[4] = (unsigned char) (end - start);
+	out[5] = (unsigned char) ((end - start) >> 8);
+	
+	return end - out;
+}
+
+/* Decode a block into jobs, returns the number of jobs. Each column is a straight loop */
+unsigned int decodeJobBlock(const unsigned char *in, Job *jobs)
+{
+	uint64_t values[2 * JOBS_PER_BLOCK];
+	const unsigned char *types;
+	unsigned int count;
+	unsigned int numAccounts;
+	unsigned int previous;
+	unsigned int code;
+	unsigned int i;
+	unsigned int k;
+	
+	count = in[0] | in[1] << 8;
+	types = in + JOB_BLOCK_HEADER;
+	numAccounts = count;
+	
+	for(i = 0; i < count; i++)
+	{
+		code = (types[i / 2] >> (i % 2 * 4)) & 0x0F;
+		jobs[i].type = jobTypeCodes[code];
+		numAccounts += code == 2;
+	}
+	
+	in = getVarints(types + (count + 1) / 2, values, numAccounts);
+	previous = 0;
+	k = 0;
+	
+	for(i = 0; i < count; i++)
+	{
+		previous += (unsigned int) unzigzag(values[k++]);
+		jobs[i].fromAccount = previous;
+		jobs[i].toAccount = ACCOUNT_NONE;
+		
+		if(jobs[i].type == 't')
 		{
-			/* Extract the transfer fee */
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &account->transferFee);
+			previous += (unsigned int) unzigzag(values[k++]);
+			jobs[i].toAccount = previous;
 		}
-		else if(strcmp(token, "transactions") == 0)
+	}
+	
+	getVarints(in, values, count);
+	
+	for(i = 0; i < count; i++)
+		jobs[i].amount = (int) unzigzag(values[i]);
+		
+	return count;
+}
+
+/* Job k of a transaction. Encoded jobs are decoded a block at a time into the cursor, which
+is cheap when the jobs are walked in order */
+Job *jobAt(JobCursor *cursor, Transaction *transaction, unsigned int k)
+{
+	const unsigned char *block;
+	unsigned int i;
+	
+	if(transaction->encodedJobs == NULL)
+		return &transaction->jobs[k];
+		
+	if(cursor->transaction != transaction || cursor->block != k / JOBS_PER_BLOCK)
+	{
+		if(cursor->transaction == transaction && cursor->block + 1 == k / JOBS_PER_BLOCK)
+			block = cursor->nextBlock;
+		else
+		{
+			block = transaction->encodedJobs;
+			
+			for(i = 0; i < k / JOBS_PER_BLOCK; i++)
+				block += jobBlockSize(block);
+		}
+		
+		decodeJobBlock(block, cursor->jobs);
+		cursor->transaction = transaction;
+		cursor->block = k / JOBS_PER_BLOCK;
+		cursor->nextBlock = block + jobBlockSize(block);
+	}
+	
+	return &cursor->jobs[k % JOBS_PER_BLOCK];
+}
+
+/* Replace the job arrays with encoded blocks, the jobs of each transaction start a new block */
+void encodeJobs()
+{
+	Transaction *transaction;
+	size_t *offsets;
+	size_t capacity;
+	unsigned int count;
+	int i;
+	int j;
+	
+	offsets = (size_t *) malloc((transactionsList.numTransactions + 1) * sizeof(size_t));
+	capacity = 0;
+	
+	for(i = 0; i < transactionsList.numTransactions; i++)
+	{
+		transaction = &transactionsList.transactions[i];
+		offsets[i] = transactionsList.encodedSize;
+		
+		for(j = 0; j < transaction->numJobs; j += count)
+		{
+			count = transaction->numJobs - j < JOBS_PER_BLOCK ? transaction->numJobs - j : JOBS_PER_BLOCK;
+			
+			if(transactionsList.encodedSize + MAX_JOB_BLOCK_BYTES > capacity)
+			{
+				capacity = capacity == 0 ? 65536 : capacity * 2;
+				transactionsList.encodedJobs = (unsigned char *) realloc(transactionsList.encodedJobs, capacity);
+			}
+			
+			transactionsList.encodedSize += encodeJobBlock(transaction->jobs + j, count, transactionsList.encodedJobs + transactionsList.encodedSize);
+		}
+	}
+	
+	/* The blocks don't move any more, so the transactions can point at them */
+	transactionsList.encodedJobs = (unsigned char *) realloc(transactionsList.encodedJobs, transactionsList.encodedSize + 1);
+	
+	for(i = 0; i < transactionsList.numTransactions; i++)
+	{
+		transactionsList.transactions[i].encodedJobs = transactionsList.encodedJobs + offsets[i];
+		transactionsList.transactions[i].jobs = NULL;
+	}
+	
+	for(i = 0; i < transactionsList.numJobArrays; i++)
+		free(transactionsList.jobArrays[i]);
+		
+	transactionsList.numJobArrays = 0;
+	free(offsets);
+}
+
+/* Decode every job block once, returns the time it took in seconds */
+double measureJobDecoding()
+{
+	Job jobs[JOBS_PER_BLOCK];
+	const unsigned char *block;
+	const unsigned char *end;
+	double startTime;
+	volatile int64_t sum;
+	int64_t total;
+	unsigned int count;
+	unsigned int i;
+	
+	startTime = now();
+	block = transactionsList.encodedJobs;
+	end = block + transactionsList.encodedSize;
+	total = 0;
+	
+	while(block < end)
+	{
+		count = decodeJobBlock(block, jobs);
+		block += jobBlockSize(block);
+		
+		for(i = 0; i < count; i++)
+			total += jobs[i].amount + jobs[i].fromAccount;
+	}
+	
+	sum = total;
+	(void) sum;
+	
+	return now() - startTime;
+}
+
+/* The ID string of an account */
+const char *accountId(unsigned int index)
+{
+	return stringPool.data + accountsList.ids[index];
+}
+
+/* ID of the account with a name number, whether it is open or not */
+const char *accountName(unsigned int name)
+{
+	return stringPool.data + directory.names[name];
+}
+
+/* Read or write a block of the store file, the part past the end of the file reads as zeros */
+void transferPage(AccountBlock *block, unsigned int blockNumber, int write)
+{
+	off_t offset;
+	ssize_t done;
+	
+	offset = (off_t) blockNumber * sizeof(AccountBlock);
+	
+	if(write)
+		done = pwrite(pagedStore.fd, block, sizeof(AccountBlock), offset);
+	else
+		done = pread(pagedStore.fd, block, sizeof(AccountBlock), offset);
+		
+	if(done < 0)
+	{
+		perror("account store");
+		exit(1);
+	}
+	
+	if(!write && (size_t) done < sizeof(AccountBlock))
+		memset((char *) block + done, 0, sizeof(AccountBlock) - done);
+}
+
+/* Frame the clock hand settles on, passing over pinned frames and taking away the second
+chance of referenced ones. ACCOUNT_NONE if every frame is pinned. The store lock must be held */
+unsigned int findVictimFrame()
+{
+	PageFrame *frame;
+	unsigned int i;
+	unsigned int index;
+	
+	for(i = 0; i < 2 * pagedStore.numFrames; i++)
+	{
+		index = pagedStore.hand;
+		frame = &pagedStore.frames[index];
+		pagedStore.hand = (pagedStore.hand + 1) % pagedStore.numFrames;
+		
+		if(frame->pinCount > 0)
+			continue;
+			
+		if(frame->referenced)
+		{
+			frame->referenced = FALSE;
+			continue;
+		}
+		
+		return index;
+	}
+	
+	return ACCOUNT_NONE;
+}
+
+/* Pin a block in the cache, reading it in if it isn't there. The disk transfers go
+without the store lock, a frame being loaded is marked and other users wait for it */
+PageFrame *pinPage(unsigned int blockNumber, int write, int prefetch)
+{
+	PageFrame *frame;
+	unsigned int index;
+	unsigned int oldBlock;
+	int writeBack;
+	
+	pthread_mutex_lock(&pagedStore.lock);
+	
+	while(TRUE)
+	{
+		index = pagedStore.pageTable[blockNumber];
+		
+		if(index != ACCOUNT_NONE && pagedStore.frames[index].loading)
+		{
+			pagedStore.numWaiting++;
+			pthread_cond_wait(&pagedStore.changed, &pagedStore.lock);
+			pagedStore.numWaiting--;
+			continue;
+		}
+		
+		if(index != ACCOUNT_NONE)
+		{
+			frame = &pagedStore.frames[index];
+			frame->pinCount++;
+			frame->referenced = TRUE;
+			frame->dirty |= write;
+			
+			if(!prefetch)
+				pagedStore.counts.hits++;
+				
+			pthread_mutex_unlock(&pagedStore.lock);
+			return frame;
+		}
+		
+		index = findVictimFrame();
+		
+		if(index != ACCOUNT_NONE)
+			break;
+			
+		pagedStore.numWaiting++;
+		pthread_cond_wait(&pagedStore.changed, &pagedStore.lock);
+		pagedStore.numWaiting--;
+	}
+	
+	if(prefetch)
+		pagedStore.counts.prefetches++;
+	else
+		pagedStore.counts.misses++;
+		
+	/* Both the old and the new block map to the frame until it is loaded, so neither
+	of them can be read from the file while the frame is in flight */
+	frame = &pagedStore.frames[index];
+	oldBlock = frame->blockNumber;
+	writeBack = oldBlock != ACCOUNT_NONE && frame->dirty;
+	frame->blockNumber = blockNumber;
+	frame->pinCount = 1;
+	frame->referenced = TRUE;
+	frame->dirty = write;
+	frame->loading = TRUE;
+	pagedStore.pageTable[blockNumber] = index;
+	pagedStore.counts.reads++;
+	pagedStore.counts.writes += writeBack;
+	pthread_mutex_unlock(&pagedStore.lock);
+	
+	if(writeBack)
+		transferPage(frame->block, oldBlock, TRUE);
+		
+	transferPage(frame->block, blockNumber, FALSE);
+	
+	pthread_mutex_lock(&pagedStore.lock);
+	
+	if(oldBlock != ACCOUNT_NONE)
+		pagedStore.pageTable[oldBlock] = ACCOUNT_NONE;
+		
+	frame->loading = FALSE;
+	
+	if(pagedStore.numWaiting > 0)
+		pthread_cond_broadcast(&pagedStore.changed);
+		
+	pthread_mutex_unlock(&pagedStore.lock);
+	
+	return frame;
+}
+
+/* Let go of a pinned frame */
+void unpinPage(PageFrame *frame)
+{
+	pthread_mutex_lock(&pagedStore.lock);
+	frame->pinCount--;
+	
+	if(frame->pinCount == 0 && pagedStore.numWaiting > 0)
+		pthread_cond_broadcast(&pagedStore.changed);
+		
+	pthread_mutex_unlock(&pagedStore.lock);
+}
+
+/* The block holding the columns of an account. With the paged store the block is pinned
+in the cache until the matching unpinAccountBlock, pins are taken under the account lock
+so only a transfer ever waits for a frame while it holds another one */
+AccountBlock *pinAccountBlock(unsigned int index, int write)
+{
+	if(!pagedStore.enabled)
+		return &accountsList.blocks[index / ACCOUNTS_PER_BLOCK];
+		
+	return pinPage(index / ACCOUNTS_PER_BLOCK, write, FALSE)->block;
+}
+
+/* Release a block taken with pinAccountBlock */
+void unpinAccountBlock(unsigned int index)
+{
+	if(pagedStore.enabled)
+		unpinPage(&pagedStore.frames[pagedStore.pageTable[index / ACCOUNTS_PER_BLOCK]]);
+}
+
+/* The fee schedule of an account in a block */
+FeeSchedule *accountFees(AccountBlock *block, unsigned int index)
+{
+	return &feeSchedulesList.schedules[block->feeSchedules[index % ACCOUNTS_PER_BLOCK]];
+}
+
+/* Keep the account blocks in a file with a cache of a given size in front of it, must be
+called before any account is added */
+int startPagedStore(const char *path, unsigned int cacheMegabytes)
+{
+	unsigned int i;
+	
+	memset(&pagedStore, 0, sizeof(PagedStore));
+	pagedStore.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	
+	if(pagedStore.fd < 0)
+		return FALSE;
+		
+	/* A transfer holds two frames, a few more keep the clock from thrashing on tiny caches */
+	pagedStore.numFrames = (unsigned int) ((uint64_t) cacheMegabytes * 1024 * 1024 / sizeof(AccountBlock));
+	
+	if(pagedStore.numFrames < 8)
+		pagedStore.numFrames = 8;
+		
+	pagedStore.memory = (AccountBlock *) malloc(pagedStore.numFrames * sizeof(AccountBlock));
+	pagedStore.frames = (PageFrame *) calloc(pagedStore.numFrames, sizeof(PageFrame));
+	
+	for(i = 0; i < pagedStore.numFrames; i++)
+	{
+		pagedStore.frames[i].block = &pagedStore.memory[i];
+		pagedStore.frames[i].blockNumber = ACCOUNT_NONE;
+	}
+	
+	pthread_mutex_init(&pagedStore.lock, NULL);
+	pthread_cond_init(&pagedStore.changed, NULL);
+	pagedStore.enabled = TRUE;
+	
+	return TRUE;
+}
+
+/* Bring the block of an open account into the cache without keeping it pinned */
+void prefetchAccount(unsigned int name)
+{
+	unsigned int index;
+	
+	index = __atomic_load_n(&directory.slots[name], __ATOMIC_ACQUIRE);
+	
+	if(index != ACCOUNT_NONE)
+		unpinPage(pinPage(index / ACCOUNTS_PER_BLOCK, FALSE, TRUE));
+}
+
+/* A method for the prefetch thread. Every pass goes over the running transactions and
+brings in the blocks of the next few jobs of each, it naps when a pass finds nothing to do */
+void *prefetchThread(void *args)
+{
+	struct timespec pause;
+	Transaction *transaction;
+	JobCursor cursor;
+	Job *job;
+	unsigned int end;
+	int worked;
+	int i;
+	
+	(void) args;
+	cursor.transaction = NULL;
+	pause.tv_sec = 0;
+	pause.tv_nsec = 50000;
+	
+	while(!__atomic_load_n(&pagedStore.stopPrefetching, __ATOMIC_RELAXED))
+	{
+		worked = FALSE;
+		
+		for(i = 0; i < MAX_PREFETCH_TRANSACTIONS; i++)
+		{
+			transaction = __atomic_load_n(&pagedStore.running[i], __ATOMIC_ACQUIRE);
+			
+			if(transaction == NULL)
+				continue;
+				
+			/* Only the prefetcher moves the prefetched mark, the progress is read as it goes */
+			end = __atomic_load_n(&transaction->progress, __ATOMIC_RELAXED) + 1;
+			
+			if(transaction->prefetched < end)
+				transaction->prefetched = end;
+				
+			end += PREFETCH_DISTANCE;
+			
+			if(end > (unsigned int) transaction->numJobs)
+				end = transaction->numJobs;
+				
+			for(; transaction->prefetched < end; transaction->prefetched++)
+			{
+				job = jobAt(&cursor, transaction, transaction->prefetched);
+				prefetchAccount(job->fromAccount);
+				
+				if(job->type == 't')
+					prefetchAccount(job->toAccount);
+					
+				worked = TRUE;
+			}
+		}
+		
+		if(!worked)
+			nanosleep(&pause, NULL);
+	}
+	
+	return (void *) NULL;
+}
+
+/* Let the prefetcher follow a transaction that is starting, unless it already follows too many */
+void addRunningTransaction(Transaction *transaction)
+{
+	Transaction *expected;
+	int i;
+	
+	for(i = 0; i < MAX_PREFETCH_TRANSACTIONS; i++)
+	{
+		expected = NULL;
+		
+		if(__atomic_compare_exchange_n(&pagedStore.running[i], &expected, transaction, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+}
+
+/* The transaction has finished, it is left where it is if it never got a place */
+void removeRunningTransaction(Transaction *transaction)
+{
+	Transaction *expected;
+	int i;
+	
+	for(i = 0; i < MAX_PREFETCH_TRANSACTIONS; i++)
+	{
+		expected = transaction;
+		
+		if(__atomic_compare_exchange_n(&pagedStore.running[i], &expected, NULL, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return;
+	}
+}
+
+/* Start prefetching for the jobs about to run */
+void startPrefetching()
+{
+	pagedStore.executeCounts = pagedStore.counts;
+	pagedStore.stopPrefetching = FALSE;
+	pthread_create(&pagedStore.prefetcher, NULL, &prefetchThread, NULL);
+}
+
+/* Stop the prefetch thread once the jobs are done */
+void stopPrefetching()
+{
+	__atomic_store_n(&pagedStore.stopPrefetching, TRUE, __ATOMIC_RELAXED);
+	pthread_join(pagedStore.prefetcher, NULL);
+	
+	pagedStore.executeCounts.hits = pagedStore.counts.hits - pagedStore.executeCounts.hits;
+	pagedStore.executeCounts.misses = pagedStore.counts.misses - pagedStore.executeCounts.misses;
+	pagedStore.executeCounts.prefetches = pagedStore.counts.prefetches - pagedStore.executeCounts.prefetches;
+	pagedStore.executeCounts.reads = pagedStore.counts.reads - pagedStore.executeCounts.reads;
+	pagedStore.executeCounts.writes = pagedStore.counts.writes - pagedStore.executeCounts.writes;
+}
+
+/* Write the dirty blocks back, after this the file holds every account */
+void stopPagedStore()
+{
+	unsigned int i;
+	
+	for(i = 0; i < pagedStore.numFrames; i++)
+	{
+		if(pagedStore.frames[i].blockNumber != ACCOUNT_NONE && pagedStore.frames[i].dirty)
+		{
+			transferPage(pagedStore.frames[i].block, pagedStore.frames[i].blockNumber, TRUE);
+			pagedStore.counts.writes++;
+		}
+	}
+	
+	close(pagedStore.fd);
+	free(pagedStore.memory);
+	free(pagedStore.frames);
+	free(pagedStore.pageTable);
+	pthread_mutex_destroy(&pagedStore.lock);
+	pthread_cond_destroy(&pagedStore.changed);
+	pagedStore.enabled = FALSE;
+}
+
+/* Bytes of the account structures the store doesn't page, which stay in memory whatever the cache size */
+uint64_t residentAccountBytes()
+{
+	uint64_t bytes;
+	
+	bytes = (uint64_t) accountsList.capacity * (sizeof(unsigned int) + sizeof(AccountLock));
+	
+	if(usePthreadLocks)
+		bytes += (uint64_t) accountsList.capacity * sizeof(pthread_mutex_t);
+		
+	bytes += stringPool.capacity;
+	bytes += (uint64_t) accountIndex.capacity * sizeof(unsigned int);
+	bytes += (uint64_t) (directory.numNames + 1) * 2 * sizeof(unsigned int);
+	bytes += (uint64_t) directory.lateNames.capacity * (sizeof(unsigned int) + sizeof(const char *));
+	bytes += (uint64_t) (directory.numCloseJobs + 1) * sizeof(RetiredSlot);
+	bytes += (uint64_t) (directory.numOpenJobs + directory.numCloseJobs + 1) * sizeof(unsigned int);
+	bytes += (uint64_t) pagedStore.numBlocks * sizeof(unsigned int);
+	
+	return bytes;
+}
+
+/* Print how well the cache did while the jobs ran, and over the whole run, and what the
+accounts keep in memory besides the cache */
+void printPagedStoreStats(FILE *outFile, double executeTime)
+{
+	const PageCounts *counts;
+	uint64_t lookups;
+	uint64_t resident;
+	
+	counts = &pagedStore.executeCounts;
+	lookups = counts->hits + counts->misses;
+	fprintf(outFile, "Store:   %u blocks, cache of %u (%.1f MB), execute hit ratio %.1f%% over %" PRIu64 " lookups, %.0f jobs/s\n",
+		pagedStore.numBlocks, pagedStore.numFrames, pagedStore.numFrames * sizeof(AccountBlock) / 1048576.0,
+		lookups > 0 ? 100.0 * counts->hits / lookups : 100.0, lookups,
+		transactionsList.numJobs / (executeTime > 0 ? executeTime : 1e-9));
+	fprintf(outFile, "         %" PRIu64 " misses, %" PRIu64 " prefetched, %" PRIu64 " blocks read, %" PRIu64 " written "
+		"(%" PRIu64 " read, %" PRIu64 " written in total)\n",
+		counts->misses, counts->prefetches, counts->reads, counts->writes, pagedStore.counts.reads, pagedStore.counts.writes);
+		
+	resident = residentAccountBytes();
+	fprintf(outFile, "         %.1f MB resident outside the cache, %.1f B per account against %.1f B per account paged\n",
+		resident / 1048576.0, (double) resident / (accountsList.numAccounts > 0 ? accountsList.numAccounts : 1),
+		(double) sizeof(AccountBlock) / ACCOUNTS_PER_BLOCK);
+}
+
+/* Tell the CPU we are in a spin loop */
+static inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* Move the spin budget an eighth of the way towards twice what this wait needed */
+void adaptSpinLimit(AccountLock *lock, uint32_t spent, int acquired)
+{
+	uint32_t limit;
+	uint32_t target;
+	
+	limit = __atomic_load_n(&lock->spinLimit, __ATOMIC_RELAXED);
+	target = acquired ? spent * 2 : MIN_SPIN_LIMIT;
+	
+	if(target > limit)
+		limit += (target - limit) / 8 + 1;
+	else
+		limit -= (limit - target) / 8;
+		
+	if(limit < MIN_SPIN_LIMIT)
+		limit = MIN_SPIN_LIMIT;
+	else if(limit > MAX_SPIN_LIMIT)
+		limit = MAX_SPIN_LIMIT;
+		
+	__atomic_store_n(&lock->spinLimit, limit, __ATOMIC_RELAXED);
+}
+
+/* Take an account lock: try once, spin with exponential backoff for up to the lock's spin
+budget, then park on the futex until the holder wakes us */
+void accountLockAcquire(AccountLock *lock)
+{
+	uint32_t expected;
+	uint32_t limit;
+	uint32_t spent;
+	uint32_t backoff;
+	uint32_t i;
+	
+	expected = 0;
+	
+	if(__atomic_compare_exchange_n(&lock->state, &expected, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+		
+	limit = __atomic_load_n(&lock->spinLimit, __ATOMIC_RELAXED);
+	backoff = 1;
+	
+	for(spent = 0; spent < limit; spent += backoff)
+	{
+		for(i = 0; i < backoff; i++)
+			cpuRelax();
+			
+		/* Only try the atomic once the lock looks free, so spinners don't bounce the line */
+		expected = 0;
+		
+		if(__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+			__atomic_compare_exchange_n(&lock->state, &expected, 1, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			adaptSpinLimit(lock, spent + backoff, TRUE);
+			return;
+		}
+		
+		if(backoff < MAX_SPIN_BACKOFF)
+			backoff *= 2;
+	}
+	
+	adaptSpinLimit(lock, spent, FALSE);
+	
+	/* Mark the lock as having sleepers and park until it is handed back as free */
+	while(__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0)
+		syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+/* Release an account lock, waking one sleeper if there are any */
+void accountLockRelease(AccountLock *lock)
+{
+	if(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+		syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Add the deposits waiting in an account's pending word to its block. The balance and the
+count go in atomically, as reservations change them without the lock */
+void foldDeposits(unsigned int index)
+{
+	AccountBlock *block;
+	uint64_t word;
+	
+	if(__atomic_load_n(&pendingDeposits.words[index], __ATOMIC_RELAXED) == 0)
+		return;
+		
+	word = __atomic_exchange_n(&pendingDeposits.words[index], 0, __ATOMIC_ACQUIRE);
+	block = pinAccountBlock(index, TRUE);
+	__atomic_fetch_add(&block->balances[index % ACCOUNTS_PER_BLOCK], (int64_t) word >> DEPOSIT_COUNT_BITS, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&block->numTransactions[index % ACCOUNTS_PER_BLOCK], (int) (word & DEPOSIT_COUNT_MASK), __ATOMIC_RELAXED);
+	unpinAccountBlock(index);
+}
+
+/* Add every pending word into the blocks, once nothing runs any more */
+void foldAllDeposits()
+{
+	unsigned int i;
+	
+	for(i = 0; i < accountsList.numAccounts; i++)
+		foldDeposits(i);
+}
+
+/* Lock an account */
+void lockAccount(unsigned int index)
+{
+	if(usePthreadLocks)
+		pthread_mutex_lock(&accountsList.mutexes[index]);
+	else
+		accountLockAcquire(&accountsList.locks[index]);
+		
+	if(pendingDeposits.enabled)
+		foldDeposits(index);
+}
+
+/* Unlock an account */
+void unlockAccount(unsigned int index)
+{
+	if(usePthreadLocks)
+		pthread_mutex_unlock(&accountsList.mutexes[index]);
+	else
+		accountLockRelease(&accountsList.locks[index]);
+}
+
+/* Return the index of an identical fee schedule, adding it if this is the first account using it */
+unsigned short findOrAddFeeSchedule(FeeSchedule *schedule, const char *type)
+{
+	static unsigned int lastMatch = 0;
+	FeeSchedule *current;
+	unsigned int i;
+	
+	/* Accounts of the same type tend to come in runs, so start looking at the last match */
+	for(i = 0; i < feeSchedulesList.numSchedules; i++)
+	{
+		current = &feeSchedulesList.schedules[(lastMatch + i) % feeSchedulesList.numSchedules];
+		
+		if(current->depositFee == schedule->depositFee &&
+			current->withdrawalFee == schedule->withdrawalFee &&
+			current->transferFee == schedule->transferFee &&
+			current->transactionFee == schedule->transactionFee &&
+			current->transactionFeeThreshold == schedule->transactionFeeThreshold &&
+			current->overdraftFee == schedule->overdraftFee &&
+			current->monthlyFee == schedule->monthlyFee &&
+			current->overdraftProtected == schedule->overdraftProtected &&
+			strcmp(stringPool.data + current->type, type) == 0)
+		{
+			lastMatch = current - feeSchedulesList.schedules;
+			return (unsigned short) lastMatch;
+		}
+	}
+	
+	if(feeSchedulesList.numSchedules == MAX_FEE_SCHEDULES)
+	{
+		fprintf(stderr, "More than %d distinct fee schedules\n", MAX_FEE_SCHEDULES);
+		exit(1);
+	}
+	
+	if(feeSchedulesList.numSchedules == feeSchedulesList.capacity)
+	{
+		feeSchedulesList.capacity = feeSchedulesList.capacity == 0 ? 16 : feeSchedulesList.capacity * 2;
+		feeSchedulesList.schedules = (FeeSchedule *) realloc(feeSchedulesList.schedules, feeSchedulesList.capacity * sizeof(FeeSchedule));
+	}
+	
+	schedule->type = internString(&stringPool, type);
+	feeSchedulesList.schedules[feeSchedulesList.numSchedules] = *schedule;
+	lastMatch = feeSchedulesList.numSchedules++;
+	
+	return (unsigned short) lastMatch;
+}
+
+/* Grow the account arrays to a new capacity, a multiple of the block size. The paged
+store keeps the blocks in its file, so only its page table grows */
+void growAccounts(unsigned int capacity)
+{
+	unsigned int numBlocks;
+	
+	numBlocks = capacity / ACCOUNTS_PER_BLOCK;
+	accountsList.ids = (unsigned int *) realloc(accountsList.ids, capacity * sizeof(unsigned int));
+	
+	if(pagedStore.enabled)
+	{
+		pagedStore.pageTable = (unsigned int *) realloc(pagedStore.pageTable, numBlocks * sizeof(unsigned int));
+		memset(pagedStore.pageTable + pagedStore.numBlocks, 0xFF, (numBlocks - pagedStore.numBlocks) * sizeof(unsigned int));
+		pagedStore.numBlocks = numBlocks;
+	}
+	else
+		accountsList.blocks = (AccountBlock *) realloc(accountsList.blocks, numBlocks * sizeof(AccountBlock));
+		
+	accountsList.capacity = capacity;
+}
+
+/* Create an account object of the details and adds it to the accounts list */
+void addAccount(char *line)
+{
+	AccountBlock *block;
+	FeeSchedule schedule;
+	const char *type;
+	char *token;
+	int slot;
+	
+	/* First token will always be the ID */
+	token = strtok(line, DELIMITERS);
+	
+	if(token == NULL)
+		return;
+	
+	if(accountsList.numAccounts == accountsList.capacity)
+		growAccounts(accountsList.capacity == 0 ? 4 * ACCOUNTS_PER_BLOCK : accountsList.capacity * 2);
+	
+	block = pinAccountBlock(accountsList.numAccounts, TRUE);
+	slot = accountsList.numAccounts % ACCOUNTS_PER_BLOCK;
+	
+	if(slot == 0)
+		memset(block, 0, sizeof(AccountBlock));
+		
+	memset(&schedule, 0, sizeof(FeeSchedule));
+	accountsList.ids[accountsList.numAccounts] = internString(&stringPool, token);
+	type = "";
+	
+	token = strtok(NULL, DELIMITERS);
+	while(token != NULL)
+	{
+		if(strcmp(token, "type") == 0)
+		{
+			/* Extract the account type */
+			token = strtok(NULL, DELIMITERS);
+			type = token;
+		}
+		else if(strcmp(token, "d") == 0)
+		{
+			/* Extract the deposit fee */
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.depositFee);
+		}
+		else if(strcmp(token, "w") == 0)
+		{
+			/* Extract the withdrawal fee */
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.withdrawalFee);
+		}
+		else if(strcmp(token, "t") == 0)
+		{
+			/* Extract the transfer fee */
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.transferFee);
+		}
+		else if(strcmp(token, "transactions") == 0)
+		{
+			/* Extract the transaction fee limit before fee can occur */
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.transactionFeeThreshold);
+			
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.transactionFee);
+		}
+		else if(strcmp(token, "monthly") == 0)
+		{
+			/* Extract the monthly fee charged by the end of day fee assessment */
+			token = strtok(NULL, DELIMITERS);
+			sscanf(token, "%d", &schedule.monthlyFee);
+		}
+		else if(strcmp(token, "overdraft") == 0)
+		{
+			/* Extract and check if account is overdraft protected */
+			token = strtok(NULL, DELIMITERS);
+			
+			if(strcmp(token, "Y") == 0)
+			{
+				block->flags[slot] |= ACCOUNT_OVERDRAFT_PROTECTED;
+				schedule.overdraftProtected = TRUE;
+				
+				token = strtok(NULL, DELIMITERS);
+				sscanf(token, "%d", &schedule.overdraftFee);
+			}
+			else
+			{
+				block->flags[slot] &= ~ACCOUNT_OVERDRAFT_PROTECTED;
+				schedule.overdraftProtected = FALSE;
+				schedule.overdraftFee = 0;
+			}
+		}
+		
+		token = strtok(NULL, DELIMITERS);
+	}
+	
+	block->feeSchedules[slot] = findOrAddFeeSchedule(&schedule, type == NULL ? "" : type);
+	unpinAccountBlock(accountsList.numAccounts);
+	accountsList.numAccounts++;
+}
+
+/* FNV-1a hash of an account ID */
+unsigned int hashId(const char *id)
+{
+	unsigned int hash;
+	
+	hash = 2166136261u;
+	
+	while(*id != '\0')
+	{
+		hash ^= (unsigned char) *id;
+		hash *= 16777619u;
+		id++;
+	}
+	
+	return hash;
+}
+
+/* Build the hash index over all loaded accounts, after this the index is only read */
+void buildAccountIndex()
+{
+	unsigned int i;
+	unsigned int slot;
+	
+	/* Keep the table at most half full so probe sequences stay short */
+	accountIndex.capacity = 16;
+	
+	while(accountIndex.capacity < 2 * accountsList.numAccounts)
+		accountIndex.capacity *= 2;
+		
+	accountIndex.slots = (unsigned int *) malloc(accountIndex.capacity * sizeof(unsigned int));
+	memset(accountIndex.slots, 0xFF, accountIndex.capacity * sizeof(unsigned int));
+	
+	for(i = 0; i < accountsList.numAccounts; i++)
+	{
+		slot = hashId(accountId(i)) & (accountIndex.capacity - 1);
+		
+		while(accountIndex.slots[slot] != ACCOUNT_NONE)
+			slot = (slot + 1) & (accountIndex.capacity - 1);
+			
+		accountIndex.slots[slot] = i;
+	}
+}
+
+/* Make room for accounts opened while the transactions run and set up the locks of every
+slot. After this the account arrays don't move again */
+void reserveAccounts(unsigned int count)
+{
+	unsigned int i;
+	
+	if(accountsList.numAccounts + count > accountsList.capacity)
+		growAccounts((accountsList.numAccounts + count + ACCOUNTS_PER_BLOCK - 1) / ACCOUNTS_PER_BLOCK * ACCOUNTS_PER_BLOCK);
+	
+	accountsList.locks = (AccountLock *) malloc((accountsList.capacity > 0 ? accountsList.capacity : 1) * sizeof(AccountLock));
+	
+	if(usePthreadLocks)
+		accountsList.mutexes = (pthread_mutex_t *) malloc((accountsList.capacity > 0 ? accountsList.capacity : 1) * sizeof(pthread_mutex_t));
+		
+	for(i = 0; i < accountsList.capacity; i++)
+	{
+		accountsList.locks[i].state = 0;
+		accountsList.locks[i].spinLimit = INITIAL_SPIN_LIMIT;
+		
+		if(usePthreadLocks)
+			pthread_mutex_init(&accountsList.mutexes[i], NULL);
+	}
+}
+
+/* Find the index of the account that holds the ID, safe to call from several threads at once */
+unsigned int findAccount(const char *id)
+{
+	unsigned int slot;
+	unsigned int index;
+	
+	slot = hashId(id) & (accountIndex.capacity - 1);
+	
+	while((index = accountIndex.slots[slot]) != ACCOUNT_NONE)
+	{
+		if(strcmp(accountId(index), id) == 0)
+			return index;
+			
+		slot = (slot + 1) & (accountIndex.capacity - 1);
+	}
+	
+	return ACCOUNT_NONE;
+}
+
+/* Number of a name, adding it to the table when it is new */
+unsigned int findOrAddName(NameTable *table, const char *name)
+{
+	unsigned int slot;
+	unsigned int number;
+	
+	/* Keep the table at most half full, growing it means putting every name back in */
+	if(2 * (table->numNames + 1) > table->capacity)
+	{
+		table->capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+		table->names = (const char **) realloc(table->names, table->capacity / 2 * sizeof(const char *));
+		free(table->slots);
+		table->slots = (unsigned int *) malloc(table->capacity * sizeof(unsigned int));
+		memset(table->slots, 0xFF, table->capacity * sizeof(unsigned int));
+		
+		for(number = 0; number < table->numNames; number++)
+		{
+			slot = hashId(table->names[number]) & (table->capacity - 1);
+			
+			while(table->slots[slot] != ACCOUNT_NONE)
+				slot = (slot + 1) & (table->capacity - 1);
+				
+			table->slots[slot] = number;
+		}
+	}
+	
+	slot = hashId(name) & (table->capacity - 1);
+	
+	while((number = table->slots[slot]) != ACCOUNT_NONE)
+	{
+		if(strcmp(table->names[number], name) == 0)
+			return number;
+			
+		slot = (slot + 1) & (table->capacity - 1);
+	}
+	
+	table->slots[slot] = table->numNames;
+	table->names[table->numNames] = name;
+	
+	return table->numNames++;
+}
+
+/* Release a name table */
+void deleteNameTable(NameTable *table)
+{
+	free(table->slots);
+	free(table->names);
+	memset(table, 0, sizeof(NameTable));
+}
+
+/* Free a thread's epoch record when the thread exits, so the next new thread can take it */
+void releaseEpochRecord(void *arg)
+{
+	__atomic_store_n(&((EpochRecord *) arg)->inUse, FALSE, __ATOMIC_RELEASE);
+}
+
+/* The epoch record of the current thread, taking a free one or adding a new one to the list */
+EpochRecord *epochRecord()
+{
+	EpochRecord *record;
+	int expected;
+	
+	if(currentEpochRecord != NULL)
+		return currentEpochRecord;
+		
+	for(record = __atomic_load_n(&epochs.records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+	{
+		expected = FALSE;
+		
+		if(__atomic_compare_exchange_n(&record->inUse, &expected, TRUE, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	
+	if(record == NULL)
+	{
+		/* Records are only added at the head and never removed while jobs run */
+		record = (EpochRecord *) calloc(1, sizeof(EpochRecord));
+		record->inUse = TRUE;
+		record->next = __atomic_load_n(&epochs.records, __ATOMIC_RELAXED);
+		
+		while(!__atomic_compare_exchange_n(&epochs.records, &record->next, record, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			continue;
+	}
+	
+	pthread_setspecific(epochs.key, record);
+	currentEpochRecord = record;
+	
+	return record;
+}
+
+/* Announce that the current thread is about to look accounts up */
+void enterEpoch()
+{
+	EpochRecord *record;
+	
+	record = epochRecord();
+	__atomic_store_n(&record->state, (__atomic_load_n(&epochs.epoch, __ATOMIC_RELAXED) << 1) | 1, __ATOMIC_RELAXED);
+	
+	/* The announcement has to be visible before any slot is read from the directory */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* The current thread holds no slot any more */
+void exitEpoch()
+{
+	__atomic_store_n(&currentEpochRecord->state, 0, __ATOMIC_RELEASE);
+}
+
+/* Move to the next epoch if every thread inside a job has seen the current one, the
+directory lock must be held */
+void advanceEpoch()
+{
+	EpochRecord *record;
+	uint64_t state;
+	
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	for(record = __atomic_load_n(&epochs.records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+	{
+		state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+		
+		if((state & 1) && (state >> 1) != epochs.epoch)
+			return;
+	}
+	
+	__atomic_store_n(&epochs.epoch, epochs.epoch + 1, __ATOMIC_RELEASE);
+}
+
+/* Move the retired slots whose grace period is over to the free list, the directory lock
+must be held */
+void reclaimAccountSlots()
+{
+	unsigned int i;
+	unsigned int j;
+	
+	if(directory.numRetired == 0)
+		return;
+		
+	advanceEpoch();
+	j = 0;
+	
+	for(i = 0; i < directory.numRetired; i++)
+	{
+		if(directory.retired[i].epoch + 2 <= epochs.epoch)
+			directory.freeSlots[directory.numFree++] = directory.retired[i].index;
+		else
+			directory.retired[j++] = directory.retired[i];
+	}
+	
+	directory.numRetired = j;
+}
+
+/* Take a slot for an account being opened, a reclaimed one if there is one */
+unsigned int takeAccountSlot()
+{
+	unsigned int index;
+	
+	pthread_mutex_lock(&directory.lock);
+	reclaimAccountSlots();
+	
+	if(directory.numFree > 0)
+	{
+		index = directory.freeSlots[--directory.numFree];
+		directory.numReused++;
+	}
+	else
+		index = accountsList.numAccounts++;
+		
+	pthread_mutex_unlock(&directory.lock);
+	
+	return index;
+}
+
+/* Hand back a slot, it is retired when it has been in the directory and free when it never was */
+void returnAccountSlot(unsigned int index, int published)
+{
+	pthread_mutex_lock(&directory.lock);
+	
+	if(published)
+	{
+		directory.retired[directory.numRetired].index = index;
+		directory.retired[directory.numRetired].epoch = epochs.epoch;
+		directory.numRetired++;
+		reclaimAccountSlots();
+	}
+	else
+		directory.freeSlots[directory.numFree++] = index;
+		
+	pthread_mutex_unlock(&directory.lock);
+}
+
+/* Give every name its number in the directory. Loaded accounts keep their slot as their
+number and start open, the late names follow them and start closed */
+void buildAccountDirectory()
+{
+	unsigned int i;
+	
+	directory.numNames = accountsList.numAccounts + directory.lateNames.numNames;
+	directory.slots = (unsigned int *) malloc((directory.numNames + 1) * sizeof(unsigned int));
+	directory.names = (unsigned int *) malloc((directory.numNames + 1) * sizeof(unsigned int));
+	
+	for(i = 0; i < accountsList.numAccounts; i++)
+	{
+		directory.slots[i] = i;
+		directory.names[i] = accountsList.ids[i];
+	}
+	
+	/* Nothing reads the string pool concurrently any more, so the late names can go in */
+	for(i = 0; i < directory.lateNames.numNames; i++)
+	{
+		directory.slots[accountsList.numAccounts + i] = ACCOUNT_NONE;
+		directory.names[accountsList.numAccounts + i] = internString(&stringPool, directory.lateNames.names[i]);
+	}
+	
+	deleteNameTable(&directory.lateNames);
+	
+	/* A slot is retired once per close, and lands on the free list at most once per open or close */
+	pthread_mutex_init(&directory.lock, NULL);
+	directory.retired = (RetiredSlot *) malloc((directory.numCloseJobs + 1) * sizeof(RetiredSlot));
+	directory.freeSlots = (unsigned int *) malloc((directory.numOpenJobs + directory.numCloseJobs + 1) * sizeof(unsigned int));
+	directory.numRetired = 0;
+	directory.numFree = 0;
+	
+	/* Slots only get reused after a close, without any the jobs can skip the epochs */
+	epochs.epoch = 0;
+	epochs.records = NULL;
+	epochs.enabled = directory.numCloseJobs > 0;
+	
+	if(epochs.enabled)
+		pthread_key_create(&epochs.key, &releaseEpochRecord);
+}
+
+/* Release the directory and the epoch records */
+void deleteAccountDirectory()
+{
+	EpochRecord *record;
+	
+	if(epochs.enabled)
+		pthread_key_delete(epochs.key);
+		
+	while(epochs.records != NULL)
+	{
+		record = epochs.records;
+		epochs.records = record->next;
+		free(record);
+	}
+	
+	free(directory.slots);
+	free(directory.names);
+	free(directory.retired);
+	free(directory.freeSlots);
+	pthread_mutex_destroy(&directory.lock);
+}
+
+/* Free a thread's metrics record when the thread exits, so the next new thread can take it over */
+void releaseMetricsRecord(void *arg)
+{
+	__atomic_store_n(&((MetricsRecord *) arg)->inUse, FALSE, __ATOMIC_RELEASE);
+}
+
+/* The metrics record of the current thread, taking a free one or adding a new one to the list */
+MetricsRecord *metricsRecord()
+{
+	MetricsRecord *record;
+	int expected;
+	
+	for(record = __atomic_load_n(&metrics.records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+	{
+		expected = FALSE;
+		
+		if(__atomic_compare_exchange_n(&record->inUse, &expected, TRUE, FALSE, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	
+	if(record == NULL)
+	{
+		/* Records are only added at the head and never removed while jobs run */
+		record = (MetricsRecord *) aligned_alloc(64, sizeof(MetricsRecord));
+		memset(record, 0, sizeof(MetricsRecord));
+		record->inUse = TRUE;
+		record->next = __atomic_load_n(&metrics.records, __ATOMIC_RELAXED);
+		
+		while(!__atomic_compare_exchange_n(&metrics.records, &record->next, record, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			continue;
+	}
+	
+	pthread_setspecific(metrics.key, record);
+	currentMetricsRecord = record;
+	
+	return record;
+}
+
+/* Add to one of the current thread's counters. The thread is the only writer of its record,
+so a relaxed load and store are enough and the exporter reading along costs it nothing */
+void countMetric(int metric, uint64_t amount)
+{
+	MetricsRecord *record;
+	
+	if(!metrics.enabled)
+		return;
+		
+	record = currentMetricsRecord != NULL ? currentMetricsRecord : metricsRecord();
+	__atomic_store_n(&record->counts[metric], __atomic_load_n(&record->counts[metric], __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/* Book the fees an account operation charged. The fee schedules can hold negative fees,
+those are booked but left out of the counter, which may only go up */
+void chargeFees(int fees)
+{
+	currentJobCharges.fees += fees;
+	
+	if(fees > 0)
+		countMetric(METRIC_FEES, fees);
+}
+
+/* Release the metrics records, once no thread counts any more */
+void deleteMetrics()
+{
+	MetricsRecord *record;
+	
+	while(metrics.records != NULL)
+	{
+		record = metrics.records;
+		metrics.records = record->next;
+		free(record);
+	}
+}
+
+/* Delete all accounts */
+void deleteAccounts()
+{
+	unsigned int i;
+	
+	for(i = 0; usePthreadLocks && i < accountsList.capacity; i++)
+		pthread_mutex_destroy(&accountsList.mutexes[i]);
+	
+	deleteAccountDirectory();
+	free(accountsList.blocks);
+	free(accountsList.ids);
+	free(accountsList.locks);
+	free(accountsList.mutexes);
+	free(pendingDeposits.words);
+	free(accountIndex.slots);
+	free(feeSchedulesList.schedules);
+	free(stringPool.data);
+}
+
+/* Delete all transactions along with the job arrays they point into */
+void deleteTransactions()
+{
+	int i;
+	
+	for(i = 0; i < transactionsList.numJobArrays; i++)
+		free(transactionsList.jobArrays[i]);
+		
+	free(transactionsList.jobArrays);
+	free(transactionsList.encodedJobs);
+	free(transactionsList.transactions);
+}
+
+/* Print all the open accounts, in the order their IDs first appear in the input */
+void printAccounts(FILE *outFile)
+{
+	AccountBlock *block;
+	unsigned int i;
+	unsigned int index;
+	
+	for(i = 0; i < directory.numNames; i++)
+	{
+		index = directory.slots[i];
+		
+		if(index == ACCOUNT_NONE)
+			continue;
+			
+		block = pinAccountBlock(index, FALSE);
+		fprintf(outFile, "%s type %s %" PRId64 "\n", 
+			accountId(index),
+			stringPool.data + accountFees(block, index)->type,
+			block->balances[index % ACCOUNTS_PER_BLOCK]);
+		unpinAccountBlock(index);
+	}
+}
+
+/* Start tracking changed accounts */
+void startDirtyTracking()
+{
+	memset(&dirtyTracker, 0, sizeof(DirtyTracker));
+	dirtyTracker.bits = (uint64_t *) calloc(accountsList.capacity / 64 + 1, sizeof(uint64_t));
+	pthread_mutex_init(&dirtyTracker.lock, NULL);
+	dirtyTracker.enabled = TRUE;
+}
+
+/* Add entries to the change list */
+void appendDirtyEntries(const DirtyEntry *entries, unsigned int count)
+{
+	pthread_mutex_lock(&dirtyTracker.lock);
+	
+	if(dirtyTracker.numEntries + count > dirtyTracker.capacity)
+	{
+		while(dirtyTracker.numEntries + count > dirtyTracker.capacity)
+			dirtyTracker.capacity = dirtyTracker.capacity == 0 ? 1024 : dirtyTracker.capacity * 2;
+			
+		dirtyTracker.entries = (DirtyEntry *) realloc(dirtyTracker.entries, dirtyTracker.capacity * sizeof(DirtyEntry));
+	}
+	
+	memcpy(dirtyTracker.entries + dirtyTracker.numEntries, entries, count * sizeof(DirtyEntry));
+	dirtyTracker.numEntries += count;
+	
+	pthread_mutex_unlock(&dirtyTracker.lock);
+}
+
+/* Remember that an account is about to change, called with the account lock held
+and the balance from before the change. The changes made without the lock call it with
+the balance they expect before they make them, so the first call always has the balance
+the account had at the checkpoint */
+void markDirty(unsigned int index, int64_t before)
+{
+	DirtyEntry entry;
+	uint64_t bit;
+	
+	if(!dirtyTracker.enabled)
+		return;
+		
+	/* Accounts already listed only cost a read of the shared bitmap word */
+	bit = (uint64_t) 1 << (index % 64);
+	
+	if(__atomic_load_n(&dirtyTracker.bits[index / 64], __ATOMIC_RELAXED) & bit)
+		return;
+		
+	if(__atomic_fetch_or(&dirtyTracker.bits[index / 64], bit, __ATOMIC_RELAXED) & bit)
+		return;
+		
+	entry.index = index;
+	entry.before = before;
+	appendDirtyEntries(&entry, 1);
+}
+
+/* Write the accounts changed since the last checkpoint and start a new one. The list is
+swapped out first and each account is read and unmarked under its own lock, so this can
+run while transactions are going. Returns the number of changed accounts */
+unsigned int emitDeltaReport(FILE *outFile, const char *label)
+{
+	DirtyEntry *entries;
+	int64_t *afters;
+	unsigned int numEntries;
+	unsigned int numChanged;
+	unsigned int index;
+	unsigned int i;
+	int64_t after;
+	
+	if(!dirtyTracker.enabled)
+		return 0;
+		
+	pthread_mutex_lock(&dirtyTracker.lock);
+	entries = dirtyTracker.entries;
+	numEntries = dirtyTracker.numEntries;
+	dirtyTracker.entries = NULL;
+	dirtyTracker.numEntries = 0;
+	dirtyTracker.capacity = 0;
+	pthread_mutex_unlock(&dirtyTracker.lock);
+	
+	afters = (int64_t *) malloc((numEntries > 0 ? numEntries : 1) * sizeof(int64_t));
+	numChanged = 0;
+	
+	for(i = 0; i < numEntries; i++)
+	{
+		index = entries[i].index;
+		
+		lockAccount(index);
+		after = pinAccountBlock(index, FALSE)->balances[index % ACCOUNTS_PER_BLOCK];
+		unpinAccountBlock(index);
+		__atomic_fetch_and(&dirtyTracker.bits[index / 64], ~((uint64_t) 1 << (index % 64)), __ATOMIC_RELAXED);
+		unlockAccount(index);
+		
+		/* Changes that cancelled out are left out of the report */
+		if(after != entries[i].before)
+		{
+			entries[numChanged] = entries[i];
+			afters[numChanged++] = after;
+		}
+	}
+	
+	fprintf(outFile, "checkpoint %s %u\n", label, numChanged);
+	
+	for(i = 0; i < numChanged; i++)
+		fprintf(outFile, "%s %" PRId64 " %" PRId64 "\n", accountId(entries[i].index), entries[i].before, afters[i]);
+	
+	free(afters);
+	free(entries);
+	
+	return numChanged;
+}
+
+/* Stop tracking changed accounts */
+void stopDirtyTracking()
+{
+	if(!dirtyTracker.enabled)
+		return;
+		
+	free(dirtyTracker.bits);
+	free(dirtyTracker.entries);
+	pthread_mutex_destroy(&dirtyTracker.lock);
+	dirtyTracker.enabled = FALSE;
+}
+
+/* Monotonic clock in nanoseconds, used by the trace */
+uint64_t nowNs()
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Called once a job holds all its account locks, takes the job's place in the global order */
+void traceAcquired()
+{
+	TraceRecord *record;
+	uint64_t time;
+	
+	record = currentTraceRecord;
+	
+	if(record == NULL)
+		return;
+		
+	/* acquireTime holds the time the job asked for its locks until here */
+	time = nowNs() - tracer.startTime;
+	record->sequence = __atomic_fetch_add(&tracer.sequence, 1, __ATOMIC_RELAXED);
+	record->waitTime = (uint32_t) (time - record->acquireTime);
+	record->acquireTime = time;
+}
+
+/* Called just before a job lets go of its account locks */
+void traceReleased()
+{
+	TraceRecord *record;
+	
+	record = currentTraceRecord;
+	
+	if(record != NULL)
+		record->holdTime = (uint32_t) (nowNs() - tracer.startTime - record->acquireTime);
+}
+
+/* Deposit an amount to an account, fees only apply for clients and not for depositors.
+Returns FALSE when the account was closed before the lock was taken */
+int depositToAccount(unsigned int index, int amount, int applyFee)
+{
+	AccountBlock *block;
+	int slot;
+	FeeSchedule *schedule;
+	int64_t before;
+	int numTransactions;
+	int fees;
+	
+	slot = index % ACCOUNTS_PER_BLOCK;
+	
+	lockAccount(index);
+	block = pinAccountBlock(index, TRUE);
+	schedule = accountFees(block, index);
+	traceAcquired();
+	
+	if(block->flags[slot] & ACCOUNT_CLOSED)
+	{
+		traceReleased();
+		unpinAccountBlock(index);
+		unlockAccount(index);
+		return FALSE;
+	}
+
+	/* Reservations change the balance and the count without the lock, so a deposit goes in
+	atomically and takes its place in the count first */
+	numTransactions = __atomic_fetch_add(&block->numTransactions[slot], 1, __ATOMIC_RELAXED);
+	LOG("Depositing $%d to account %s with starting balance of $%" PRId64 "\n", amount, accountId(index), 
+		__atomic_load_n(&block->balances[slot], __ATOMIC_RELAXED));
+			
+	/* Calculate any added fees */
+	fees = 0;	
+	
+	if(applyFee)
+	{
+		fees = schedule->depositFee;
+		LOG("    Deposit fee of $%d\n", schedule->depositFee);
+	}
+	
+	if(applyFee && numTransactions > schedule->transactionFeeThreshold)
+	{
+		LOG("    Transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			schedule->transactionFee, numTransactions, schedule->transactionFeeThreshold);
+		fees += schedule->transactionFee;
+	}
+	
+	/* Marked before the balance changes. The balance read may already be stale by the add,
+	but only when a reservation changed it since, and that reservation marked it first */
+	markDirty(index, __atomic_load_n(&block->balances[slot], __ATOMIC_RELAXED));
+	before = __atomic_fetch_add(&block->balances[slot], (int64_t) amount - fees, __ATOMIC_RELAXED);
+	chargeFees(fees);
+	currentJobCharges.deposited += amount;
+	LOG("    Ending balance of $%" PRId64 "\n", before + amount - fees);
+	LOG("\n");
+
+	traceReleased();
+	unpinAccountBlock(index);
+	unlockAccount(index);
+	
+	return TRUE;
+}
+
+/* A depositor's deposit with -D, a single fetch-add on the account's pending word and no
+look at the block. A word getting full is added into the block under the lock */
+void depositWithoutLock(unsigned int index, int amount)
+{
+	uint64_t word;
+	int64_t pending;
+	
+	word = __atomic_fetch_add(&pendingDeposits.words[index], ((uint64_t) (int64_t) amount << DEPOSIT_COUNT_BITS) + 1, __ATOMIC_RELEASE);
+	pending = (int64_t) word >> DEPOSIT_COUNT_BITS;
+	
+	if((word & DEPOSIT_COUNT_MASK) >= MAX_PENDING_DEPOSITS || pending >= MAX_PENDING_SUM || pending <= -MAX_PENDING_SUM)
+	{
+		lockAccount(index);
+		unlockAccount(index);
+	}
+}
+
+/* Withdraw from account, returns FALSE when the account was closed before the lock was taken */
+int withdrawFromAccount(unsigned int index, int amount)
+{
+	AccountBlock *block;
+	int slot;
+	FeeSchedule *schedule;
+	int fees;
+	int num500s;
+	
+	slot = index % ACCOUNTS_PER_BLOCK;
+
+	lockAccount(index);
+	block = pinAccountBlock(index, TRUE);
+	schedule = accountFees(block, index);
+	traceAcquired();
+	
+	if(block->flags[slot] & ACCOUNT_CLOSED)
+	{
+		traceReleased();
+		unpinAccountBlock(index);
+		unlockAccount(index);
+		return FALSE;
+	}
+
+	LOG("Withdrawing $%d from account %s with starting balance of $%" PRId64 "\n", amount, accountId(index), block->balances[slot]);
+
+	/* Calculate any added fees */			
+	fees = schedule->withdrawalFee;
+	LOG("    Withdrawal fee of $%d\n", schedule->withdrawalFee);
+	
+	if(block->numTransactions[slot] > schedule->transactionFeeThreshold)
+	{
+		LOG("    Transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			schedule->transactionFee, block->numTransactions[slot], schedule->transactionFeeThreshold);
+		fees += schedule->transactionFee;	
+	}
+	
+	/* Check balance... */
+	if(block->balances[slot] >= amount + fees)
+	{				
+		/* Safe side... there's enough balance to withdraw */
+		markDirty(index, block->balances[slot]);
+		block->balances[slot] -= amount;
+		block->balances[slot] -= fees;
+		block->numTransactions[slot]++;				
+		chargeFees(fees);
+		currentJobCharges.withdrawn += amount;
+	}
+	else if(block->flags[slot] & ACCOUNT_OVERDRAFT_PROTECTED)
+	{
+		/* Negative balance side.. applicable only for overdraft protected accounts */
+		num500s = (amount / 500) + 1;
+		fees += num500s * schedule->overdraftFee;
+		
+		LOG("    Overdraft fee of $%d ($%d fee for every excess of $500)\n", num500s * schedule->overdraftFee, schedule->overdraftFee);
+	
+		/* Debt shouldn't go below -5000 */				
+		if(block->balances[slot] - fees - amount >= -5000)
+		{
+			markDirty(index, block->balances[slot]);
+			block->balances[slot] -= amount;
+			block->balances[slot] -= fees;
+			block->numTransactions[slot]++;
+			chargeFees(fees);
+			currentJobCharges.withdrawn += amount;
+		}
+		else
+		{
+			LOG("    Withdrawal rejected, amount (with fees) cannot continue \n");
+			LOG("        because overdraft limit cannot go above $5000\n");
+			countMetric(METRIC_WITHDRAWALS_REJECTED, 1);
+		}
+	}
+	else
+	{
+		LOG("    Withdrawal rejected, amount (with fees) cannot continue \n");
+		LOG("        because of insufficient balance and account not overdraft protected\n");
+		countMetric(METRIC_WITHDRAWALS_REJECTED, 1);
+	}
+	
+	LOG("    Ending balance of $%" PRId64 "\n", block->balances[slot]);	
+	LOG("\n");
+
+	traceReleased();
+	unpinAccountBlock(index);
+	unlockAccount(index);
+	
+	return TRUE;
+}
+
+/* Transfer a fund from one account to another, returns FALSE when either account was closed
+before the locks were taken */
+int transferFundsFromAndToAccount(unsigned int fromIndex, unsigned int toIndex, int amount)
+{
+	AccountBlock *fromBlock;
+	AccountBlock *toBlock;
+	int fromSlot;
+	int toSlot;
+	FeeSchedule *fromSchedule;
+	FeeSchedule *toSchedule;
+	int senderFees;
+	int receiverFees;
+	int num500s;
+	
+	fromSlot = fromIndex % ACCOUNTS_PER_BLOCK;
+	toSlot = toIndex % ACCOUNTS_PER_BLOCK;
+	
+	pthread_mutex_lock(&transferFundsLock);
+	lockAccount(fromIndex);	
+	lockAccount(toIndex);
+	fromBlock = pinAccountBlock(fromIndex, TRUE);
+	toBlock = pinAccountBlock(toIndex, TRUE);
+	fromSchedule = accountFees(fromBlock, fromIndex);
+	toSchedule = accountFees(toBlock, toIndex);
+	traceAcquired();
+	
+	if((fromBlock->flags[fromSlot] | toBlock->flags[toSlot]) & ACCOUNT_CLOSED)
+	{
+		traceReleased();
+		unpinAccountBlock(toIndex);
+		unpinAccountBlock(fromIndex);
+		unlockAccount(toIndex);
+		unlockAccount(fromIndex);
+		pthread_mutex_unlock(&transferFundsLock);
+		return FALSE;
+	}
+	
+	LOG("Transferring $%d from %s to %s\n", amount, accountId(fromIndex), accountId(toIndex));
+	LOG("    Account (Sender) %s has starting balance of $%" PRId64 "\n", accountId(fromIndex), fromBlock->balances[fromSlot]);
+	LOG("    Account (Receiver) %s has starting balance of $%" PRId64 "\n", accountId(toIndex), toBlock->balances[toSlot]);
+	
+	senderFees = fromSchedule->transferFee;
+	receiverFees = toSchedule->transferFee;
+	
+	LOG("    Account (Sender) %s has transfer fee of $%d\n", accountId(fromIndex), fromSchedule->transferFee);
+	LOG("    Account (Receiver) %s has transfer fee of $%d\n", accountId(toIndex), toSchedule->transferFee);
+	
+	if(fromBlock->numTransactions[fromSlot] > fromSchedule->transactionFeeThreshold)
+	{
+		LOG("    Account (Sender) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(fromIndex), fromSchedule->transactionFee, 
+			fromBlock->numTransactions[fromSlot], fromSchedule->transactionFeeThreshold);
+		senderFees += fromSchedule->transactionFee;
+	}
+	
+	if(toBlock->numTransactions[toSlot] > toSchedule->transactionFeeThreshold)
+	{
+		LOG("    Account (Receiver) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(toIndex), toSchedule->transactionFee, 
+			toBlock->numTransactions[toSlot], toSchedule->transactionFeeThreshold);
+		receiverFees += toSchedule->transactionFee;
+	}
+
+	/* Overdraft is not applicable for fund transfer, we assume that the account where to get money
+	has enough balance to transfer */		
+	if(fromBlock->balances[fromSlot] >= amount + senderFees)
+	{
+		/* Safe side no penalties */
+		markDirty(fromIndex, fromBlock->balances[fromSlot]);
+		markDirty(toIndex, toBlock->balances[toSlot]);
+		fromBlock->balances[fromSlot] -= amount;
+		fromBlock->balances[fromSlot] -= senderFees;
+		fromBlock->numTransactions[fromSlot]++;	
+		
+		toBlock->balances[toSlot] += amount;
+		toBlock->balances[toSlot] -= receiverFees;
+		toBlock->numTransactions[toSlot]++;
+		chargeFees(senderFees + receiverFees);
+	}
+	else if(fromBlock->flags[fromSlot] & ACCOUNT_OVERDRAFT_PROTECTED)
+	{
+		/* Negative balance side.. applicable only for overdraft protected accounts */
+		num500s = (amount / 500) + 1;
+		senderFees += num500s * fromSchedule->overdraftFee;
+		
+		LOG("    Account %s (Sender) has overdraft fee of $%d ($%d fee for every excess of $500)\n", 
+			accountId(fromIndex),
+			num500s * fromSchedule->overdraftFee, fromSchedule->overdraftFee);
+	
+		/* Debt shouldn't go below -5000 */				
+		if(fromBlock->balances[fromSlot] - senderFees - amount >= -5000)
+		{
+			markDirty(fromIndex, fromBlock->balances[fromSlot]);
+			fromBlock->balances[fromSlot] -= amount;
+			fromBlock->balances[fromSlot] -= senderFees;
+			fromBlock->numTransactions[fromSlot]++;
+			chargeFees(senderFees);
+			currentJobCharges.forfeited += amount;
+		}
+		else
+		{
+			LOG("    Transfer rejected, amount (with fees) cannot continue \n");
+			LOG("        because overdraft limit cannot go above $5000 for sender\n");
+			countMetric(METRIC_TRANSFERS_REJECTED, 1);
+		}
+	}
+	else
+	{
+		LOG("    Transfer rejected, amount (with fees) cannot continue \n");
+		LOG("        because of insufficient balance of sender\n");
+		countMetric(METRIC_TRANSFERS_REJECTED, 1);
+	}
+	
+	LOG("    Account %s has ending balance of $%" PRId64 "\n", accountId(fromIndex), fromBlock->balances[fromSlot]);	
+	LOG("    Account %s has ending balance of $%" PRId64 "\n", accountId(toIndex), toBlock->balances[toSlot]);
+	LOG("\n");
+
+	traceReleased();
+	unpinAccountBlock(toIndex);
+	unpinAccountBlock(fromIndex);
+	unlockAccount(toIndex);
+	unlockAccount(fromIndex);
+	pthread_mutex_unlock(&transferFundsLock);
+	
+	return TRUE;
+}
+
+/* Take the amount and the fees of a withdrawal or of the sending side of a transfer off a
+balance, without the account lock. The fees are priced like withdrawFromAccount prices
+them, from the count of transactions the reservation claims with a fetch-add before it
+prices, so reservations made together on an account each pay for their own place. The
+swap only goes through while the balance still covers them or stays above the -5000 floor.
+Returns FALSE when it doesn't, giving the claimed transaction back. One priced while it
+was claimed keeps the fee of that place, as though it ran after the rejected one counted.
+There is no commit step, the funds are taken once the swap goes through. The caller keeps
+the block pinned in case it has to release them */
+int reserveFunds(unsigned int index, AccountBlock *block, int amount, int fee, Reservation *reservation)
+{
+	FeeSchedule *schedule;
+	int64_t balance;
+	int slot;
+	int fees;
+	int reserved;
+	
+	slot = index % ACCOUNTS_PER_BLOCK;
+	schedule = accountFees(block, index);
+	
+	if(pendingDeposits.enabled)
+		foldDeposits(index);
+		
+	balance = __atomic_load_n(&block->balances[slot], __ATOMIC_RELAXED);
+	
+	reservation->index = index;
+	reservation->block = block;
+	reservation->schedule = schedule;
+	reservation->amount = amount;
+	reservation->numTransactions = __atomic_fetch_add(&block->numTransactions[slot], 1, __ATOMIC_RELAXED);
+	reservation->transactionFee = reservation->numTransactions > schedule->transactionFeeThreshold ? schedule->transactionFee : 0;
+	
+	while(TRUE)
+	{
+		reservation->overdraftFee = 0;
+		reservation->overdrafted = FALSE;
+		fees = fee + reservation->transactionFee;
+		reserved = balance >= amount + fees;
+		
+		/* Overdraft protected accounts go into debt, down to the floor */
+		if(!reserved && (block->flags[slot] & ACCOUNT_OVERDRAFT_PROTECTED))
+		{
+			reservation->overdraftFee = ((amount / 500) + 1) * schedule->overdraftFee;
+			reservation->overdrafted = TRUE;
+			fees += reservation->overdraftFee;
+			reserved = balance - fees - amount >= -5000;
+		}
+		
+		reservation->before = balance;
+		reservation->fees = fees;
+		
+		if(!reserved)
+		{
+			__atomic_fetch_sub(&block->numTransactions[slot], 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&reservations.numRejected, 1, __ATOMIC_RELAXED);
+			return FALSE;
+		}
+		
+		/* Marked with the balance the swap expects, an account is marked before anything
+		changes it so the first mark holds the balance of the checkpoint */
+		markDirty(index, balance);
+		
+		if(__atomic_compare_exchange_n(&block->balances[slot], &balance, balance - amount - fees, TRUE, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return TRUE;
+			
+		__atomic_fetch_add(&reservations.numRetries, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* Give the funds and the claimed transaction of a reservation back */
+void releaseReservation(Reservation *reservation)
+{
+	__atomic_fetch_add(&reservation->block->balances[reservation->index % ACCOUNTS_PER_BLOCK],
+		(int64_t) reservation->amount + reservation->fees, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&reservation->block->numTransactions[reservation->index % ACCOUNTS_PER_BLOCK], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&reservations.numReleased, 1, __ATOMIC_RELAXED);
+}
+
+/* Withdraw from an account through a reservation, the same withdrawal as withdrawFromAccount
+with the narrative told once the funds are taken. Returns FALSE when the account is closed */
+int withdrawWithReservation(unsigned int index, int amount)
+{
+	Reservation reservation;
+	AccountBlock *block;
+	int reserved;
+	
+	block = pinAccountBlock(index, TRUE);
+	
+	if(block->flags[index % ACCOUNTS_PER_BLOCK] & ACCOUNT_CLOSED)
+	{
+		unpinAccountBlock(index);
+		return FALSE;
+	}
+		
+	reserved = reserveFunds(index, block, amount, accountFees(block, index)->withdrawalFee, &reservation);
+	
+	if(reserved)
+	{
+		chargeFees(reservation.fees);
+		currentJobCharges.withdrawn += amount;
+	}
+	else
+		countMetric(METRIC_WITHDRAWALS_REJECTED, 1);
+		
+	LOG("Withdrawing $%d from account %s with starting balance of $%" PRId64 "\n", amount, accountId(index), reservation.before);
+	LOG("    Withdrawal fee of $%d\n", reservation.schedule->withdrawalFee);
+	
+	if(reservation.transactionFee > 0)
+	{
+		LOG("    Transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			reservation.transactionFee, reservation.numTransactions, reservation.schedule->transactionFeeThreshold);
+	}
+	
+	if(reservation.overdrafted)
+		LOG("    Overdraft fee of $%d ($%d fee for every excess of $500)\n", reservation.overdraftFee, reservation.schedule->overdraftFee);
+		
+	if(!reserved)
+	{
+		LOG("    Withdrawal rejected, amount (with fees) cannot continue \n");
+		LOG("        because %s\n", block->flags[index % ACCOUNTS_PER_BLOCK] & ACCOUNT_OVERDRAFT_PROTECTED ?
+			"overdraft limit cannot go above $5000" : "of insufficient balance and account not overdraft protected");
+	}
+	
+	LOG("    Ending balance of $%" PRId64 "\n", reserved ? reservation.before - amount - reservation.fees : reservation.before);
+	LOG("\n");
+	
+	unpinAccountBlock(index);
+	
+	return TRUE;
+}
+
+/* Transfer through a reservation on the sender, the same transfer as
+transferFundsFromAndToAccount without any lock. As there, a sender going into overdraft
+pays but the receiver gets nothing. The receiver's fees are priced from the count its own
+increment returns, and the sender's funds go back if the receiver turns out to be closed.
+Returns FALSE when either account is closed */
+int transferWithReservation(unsigned int fromIndex, unsigned int toIndex, int amount)
+{
+	Reservation reservation;
+	AccountBlock *fromBlock;
+	AccountBlock *toBlock;
+	FeeSchedule *toSchedule;
+	int64_t toBefore;
+	int toSlot;
+	int numTransactions;
+	int receiverFees;
+	int reserved;
+	int credited;
+	
+	toSlot = toIndex % ACCOUNTS_PER_BLOCK;
+	
+	/* Holding one frame while waiting for another is only safe for one transfer at a time,
+	so with the paged store both are pinned under the lock the locked transfers hold */
+	if(pagedStore.enabled)
+		pthread_mutex_lock(&transferFundsLock);
+		
+	fromBlock = pinAccountBlock(fromIndex, TRUE);
+	toBlock = pinAccountBlock(toIndex, TRUE);
+	
+	if(pagedStore.enabled)
+		pthread_mutex_unlock(&transferFundsLock);
+	
+	if((fromBlock->flags[fromIndex % ACCOUNTS_PER_BLOCK] | toBlock->flags[toSlot]) & ACCOUNT_CLOSED)
+	{
+		unpinAccountBlock(toIndex);
+		unpinAccountBlock(fromIndex);
+		return FALSE;
+	}
+	
+	reserved = reserveFunds(fromIndex, fromBlock, amount, accountFees(fromBlock, fromIndex)->transferFee, &reservation);
+	toSchedule = accountFees(toBlock, toIndex);
+	receiverFees = toSchedule->transferFee;
+	numTransactions = __atomic_load_n(&toBlock->numTransactions[toSlot], __ATOMIC_RELAXED);
+	toBefore = __atomic_load_n(&toBlock->balances[toSlot], __ATOMIC_RELAXED);
+	
+	if(toBlock->flags[toSlot] & ACCOUNT_CLOSED)
+	{
+		if(reserved)
+			releaseReservation(&reservation);
+			
+		unpinAccountBlock(toIndex);
+		unpinAccountBlock(fromIndex);
+		return FALSE;
+	}
+	
+	credited = reserved && !reservation.overdrafted;
+	
+	if(credited)
+	{
+		numTransactions = __atomic_fetch_add(&toBlock->numTransactions[toSlot], 1, __ATOMIC_RELAXED);
+		
+		if(numTransactions > toSchedule->transactionFeeThreshold)
+			receiverFees += toSchedule->transactionFee;
+			
+		markDirty(toIndex, toBefore);
+		toBefore = __atomic_fetch_add(&toBlock->balances[toSlot], (int64_t) amount - receiverFees, __ATOMIC_RELAXED);
+	}
+	
+	if(reserved)
+	{
+		chargeFees(reservation.fees + (credited ? receiverFees : 0));
+		currentJobCharges.forfeited += credited ? 0 : amount;
+	}
+	else
+		countMetric(METRIC_TRANSFERS_REJECTED, 1);
+	
+	LOG("Transferring $%d from %s to %s\n", amount, accountId(fromIndex), accountId(toIndex));
+	LOG("    Account (Sender) %s has starting balance of $%" PRId64 "\n", accountId(fromIndex), reservation.before);
+	LOG("    Account (Receiver) %s has starting balance of $%" PRId64 "\n", accountId(toIndex), toBefore);
+	LOG("    Account (Sender) %s has transfer fee of $%d\n", accountId(fromIndex), reservation.schedule->transferFee);
+	LOG("    Account (Receiver) %s has transfer fee of $%d\n", accountId(toIndex), toSchedule->transferFee);
+	
+	if(reservation.transactionFee > 0)
+	{
+		LOG("    Account (Sender) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(fromIndex), reservation.transactionFee, reservation.numTransactions, reservation.schedule->transactionFeeThreshold);
+	}
+	
+	if(numTransactions > toSchedule->transactionFeeThreshold)
+	{
+		LOG("    Account (Receiver) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(toIndex), toSchedule->transactionFee, numTransactions, toSchedule->transactionFeeThreshold);
+	}
+	
+	if(reservation.overdrafted)
+	{
+		LOG("    Account %s (Sender) has overdraft fee of $%d ($%d fee for every excess of $500)\n", 
+			accountId(fromIndex), reservation.overdraftFee, reservation.schedule->overdraftFee);
+	}
+	
+	if(!reserved)
+	{
+		LOG("    Transfer rejected, amount (with fees) cannot continue \n");
+		LOG("        because %s\n", reservation.overdrafted ? "overdraft limit cannot go above $5000 for sender" : "of insufficient balance of sender");
+	}
+	
+	LOG("    Account %s has ending balance of $%" PRId64 "\n", accountId(fromIndex), reserved ? reservation.before - amount - reservation.fees : reservation.before);
+	LOG("    Account %s has ending balance of $%" PRId64 "\n", accountId(toIndex), credited ? toBefore + amount - receiverFees : toBefore);
+	LOG("\n");
+	
+	unpinAccountBlock(toIndex);
+	unpinAccountBlock(fromIndex);
+	
+	return TRUE;
+}
+
+/* Slot of the account open under a name, or ACCOUNT_NONE. A job that doesn't find its account
+still takes its place in a trace, and then looks once more so an open that raced it is
+ordered before it. When that look finds the account the job takes its ticket again under
+the lock, as a ticket taken before the lock could be passed by a job that locks first */
+unsigned int findOpenAccount(unsigned int name)
+{
+	unsigned int index;
+	
+	index = __atomic_load_n(&directory.slots[name], __ATOMIC_ACQUIRE);
+	
+	if(index != ACCOUNT_NONE || currentTraceRecord == NULL)
+		return index;
+		
+	traceAcquired();
+	index = __atomic_load_n(&directory.slots[name], __ATOMIC_ACQUIRE);
+	
+	if(index == ACCOUNT_NONE)
+		traceReleased();
+		
+	return index;
+}
+
+/* Open an account with a zero balance under a name that isn't open, returns FALSE if it is */
+int openAccount(unsigned int name, unsigned short feeSchedule)
+{
+	AccountBlock *block;
+	unsigned int index;
+	unsigned int expected;
+	int slot;
+	int opened;
+	
+	index = takeAccountSlot();
+	slot = index % ACCOUNTS_PER_BLOCK;
+	
+	/* The lock is held while the slot is published, so a close of the new account comes
+	after the open in a trace */
+	lockAccount(index);
+	block = pinAccountBlock(index, TRUE);
+	
+	/* Nothing can reach the slot yet, the flag comes from the type like at load time */
+	block->balances[slot] = 0;
+	block->numTransactions[slot] = 0;
+	block->feeSchedules[slot] = feeSchedule;
+	block->flags[slot] = feeSchedulesList.schedules[feeSchedule].overdraftProtected ? ACCOUNT_OVERDRAFT_PROTECTED : 0;
+	accountsList.ids[index] = directory.names[name];
+	
+	expected = ACCOUNT_NONE;
+	opened = __atomic_compare_exchange_n(&directory.slots[name], &expected, index, FALSE, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	traceAcquired();
+	
+	if(opened)
+	{
+		LOG("Opening account %s of type %s\n\n", accountId(index), stringPool.data + feeSchedulesList.schedules[feeSchedule].type);
+		markDirty(index, 0);
+		__atomic_fetch_add(&directory.numOpened, 1, __ATOMIC_RELAXED);
+	}
+	else
+		block->flags[slot] = ACCOUNT_CLOSED;
+	
+	traceReleased();
+	unpinAccountBlock(index);
+	unlockAccount(index);
+	
+	if(!opened)
+		returnAccountSlot(index, FALSE);
+		
+	return opened;
+}
+
+/* Close the account open under a name, paying out its balance. Returns FALSE if it isn't open */
+int closeAccount(unsigned int name)
+{
+	AccountBlock *block;
+	unsigned int index;
+	int slot;
+	
+	index = findOpenAccount(name);
+	
+	if(index == ACCOUNT_NONE)
+		return FALSE;
+		
+	slot = index % ACCOUNTS_PER_BLOCK;
+	
+	lockAccount(index);
+	block = pinAccountBlock(index, TRUE);
+	traceAcquired();
+	
+	if(block->flags[slot] & ACCOUNT_CLOSED)
+	{
+		traceReleased();
+		unpinAccountBlock(index);
+		unlockAccount(index);
+		return FALSE;
+	}
+	
+	LOG("Closing account %s, paying out the balance of $%" PRId64 "\n\n", accountId(index), block->balances[slot]);
+	markDirty(index, block->balances[slot]);
+	currentJobCharges.paidOut += block->balances[slot];
+	block->balances[slot] = 0;
+	block->flags[slot] |= ACCOUNT_CLOSED;
+	__atomic_store_n(&directory.slots[name], ACCOUNT_NONE, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&directory.numClosed, 1, __ATOMIC_RELAXED);
+	
+	traceReleased();
+	unpinAccountBlock(index);
+	unlockAccount(index);
+	
+	/* Jobs that found the slot before it left the directory may still be about to lock it */
+	returnAccountSlot(index, TRUE);
+	
+	return TRUE;
+}
+
+/* Run a single job of a transaction, jobs on accounts that aren't open are rejected */
+void executeJob(Transaction *transaction, Job *currentJob)
+{
+	unsigned int fromIndex;
+	unsigned int toIndex;
+	int done;
+	
+	/* Slots found in the directory stay valid until the job leaves its epoch */
+	if(epochs.enabled)
+		enterEpoch();
+		
+	done = FALSE;
+	
+	if(currentJob->type == 'd')
+	{
+		/* Perform a deposit on an account */			
+		LOG("%s deposit $%d to account %s\n", transaction->id, currentJob->amount, accountName(currentJob->fromAccount));
+		fromIndex = findOpenAccount(currentJob->fromAccount);
+		
+		/* Fees apply only to clients and not to depositors */
+		if(fromIndex == ACCOUNT_NONE)
+			done = FALSE;
+		else if(transaction->id[0] == 'd' && pendingDeposits.enabled)
+		{
+			depositWithoutLock(fromIndex, currentJob->amount);
+			done = TRUE;
+		}
+		else if(transaction->id[0] == 'd')
+			done = depositToAccount(fromIndex, currentJob->amount, FALSE);
+		else
+			done = depositToAccount(fromIndex, currentJob->amount, TRUE);
+	}
+	else if(currentJob->type == 'w')
+	{
+		/* Peform a withdrawal on an account */			
+		LOG("%s withdraw $%d from account %s\n", transaction->id, currentJob->amount, accountName(currentJob->fromAccount));
+		fromIndex = findOpenAccount(currentJob->fromAccount);
+		
+		if(fromIndex == ACCOUNT_NONE)
+			done = FALSE;
+		else if(reservations.enabled)
+			done = withdrawWithReservation(fromIndex, currentJob->amount);
+		else
+			done = withdrawFromAccount(fromIndex, currentJob->amount);
+	}
+	else if(currentJob->type == 't')
+	{
+		/* Perform a fund transferfrom one account to another */			
+		LOG("%s transfers $%d from account %s to account %s\n", transaction->id, 
+			currentJob->amount, accountName(currentJob->fromAccount), accountName(currentJob->toAccount));
+		fromIndex = findOpenAccount(currentJob->fromAccount);
+		toIndex = fromIndex == ACCOUNT_NONE ? ACCOUNT_NONE : findOpenAccount(currentJob->toAccount);
+		
+		if(toIndex == ACCOUNT_NONE)
+			done = FALSE;
+		else if(reservations.enabled)
+			done = transferWithReservation(fromIndex, toIndex, currentJob->amount);
+		else
+			done = transferFundsFromAndToAccount(fromIndex, toIndex, currentJob->amount);
+	}
+	else if(currentJob->type == 'o')
+	{
+		/* Open a new account */
+		LOG("%s opens account %s\n", transaction->id, accountName(currentJob->fromAccount));
+		done = openAccount(currentJob->fromAccount, (unsigned short) currentJob->amount);
+	}
+	else if(currentJob->type == 'x')
+	{
+		/* Close an account */
+		LOG("%s closes account %s\n", transaction->id, accountName(currentJob->fromAccount));
+		done = closeAccount(currentJob->fromAccount);
+	}
+	
+	if(!done)
+	{
+		LOG("    Job rejected, account %s\n\n", currentJob->type == 'o' ? "is already open" : "is not open");
+		__atomic_fetch_add(&directory.numRejected, 1, __ATOMIC_RELAXED);
+	}
+	
+	countMetric(done ? METRIC_JOBS_APPLIED : METRIC_JOBS_REJECTED, 1);
+	
+	if(epochs.enabled)
+		exitEpoch();
+}
+
+/* Run all the jobs of a transaction in order */
+void executeTransaction(Transaction *transaction)
+{
+	JobCursor cursor;
+	uint64_t startTime;
+	int i;
+	
+	LOG("%s thread is running...\n", transaction->id);
+	cursor.transaction = NULL;
+	startTime = metrics.enabled ? nowNs() : 0;
+	
+	if(pagedStore.enabled)
+		addRunningTransaction(transaction);
+	
+	/* Do all sequence of transaction */
+	for(i = 0; i < transaction->numJobs; i++)
+	{
+		if(pagedStore.enabled)
+			__atomic_store_n(&transaction->progress, i, __ATOMIC_RELAXED);
+			
+
+		if(tracer.enabled)
+		{
+			currentTraceRecord = &tracer.records[transaction->jobBase + i];
+			currentTraceRecord->acquireTime = nowNs() - tracer.startTime;
+		}
+		
+		executeJob(transaction, jobAt(&cursor, transaction, i));
+	}
+	
+	currentTraceRecord = NULL;
+	
+	if(pagedStore.enabled)
+		removeRunningTransaction(transaction);
+		
+	/* The time spent in transactions is what the exporter reports as worker utilization */
+	if(metrics.enabled)
+	{
+		countMetric(METRIC_BUSY_NS, nowNs() - startTime);
+		countMetric(METRIC_TRANSACTIONS, 1);
+	}
+	
+	LOG("%s finished...\n", transaction->id);
+}
+
+/* A method for each transaction thread, runs in parallel */
+void *transactionThread(void *args)
+{
+	Transaction *transaction;
+	
+	/* Extract transaction information */
+	transaction = (Transaction *) args;
+	
+	if(transaction->id[0] == 'c')
+	{	
+		/* Clients have to wait for all depositors to finish before continuing */
+		pthread_mutex_lock(&clientsLock);
+		
+		while(numDepositorsFinished < numDepositorsRunning)
+			pthread_cond_wait(&clientsWait, &clientsLock);		
+			
+		pthread_mutex_unlock(&clientsLock);	
+	}
+	
+	executeTransaction(transaction);
+	
+	/* A depositor updates when it is done and wakes the clients if its ready for them to go */
+	if(transaction->id[0] == 'd')
+	{
+		pthread_mutex_lock(&clientsLock);
+		numDepositorsFinished++;
+		
+		if(numDepositorsFinished == numDepositorsRunning)
+			pthread_cond_broadcast(&clientsWait);
+			
+		pthread_mutex_unlock(&clientsLock);
+	}
+	
+	return (void *) NULL;
+}
+
+/* Work item wrapper around executeTransaction */
+void transactionWork(void *arg)
+{
+	executeTransaction((Transaction *) arg);
+}
+
+/* Priority class of a transaction, clients are interactive and depositors are bulk feeds */
+int transactionClass(Transaction *transaction)
+{
+	if(transaction->id[0] == 'c')
+		return CLASS_INTERACTIVE;
+		
+	return CLASS_BULK;
+}
+
+/* Take the next item according to the class weights, the scheduler lock must be held.
+Each round a class may take up to its weight in items, so the interactive class gets
+most of the workers under load but the lower classes still move every round */
+WorkItem *dequeueWork(int *workClass)
+{
+	WorkQueue *queue;
+	WorkItem *item;
+	int round;
+	int i;
+	
+	for(round = 0; round < 2; round++)
+	{
+		for(i = scheduler.currentClass; i < NUM_CLASSES; i++)
+		{
+			queue = &scheduler.queues[i];
+			
+			if(queue->head == NULL || queue->credits == 0)
+				continue;
+				
+			item = queue->head;
+			queue->head = item->next;
+			
+			if(queue->head == NULL)
+				queue->tail = NULL;
+				
+			queue->length--;
+			queue->credits--;
+			scheduler.currentClass = i;
+			*workClass = i;
+			
+			return item;
+		}
+		
+		/* Every class with work has used its share, start a new round */
+		for(i = 0; i < NUM_CLASSES; i++)
+			scheduler.queues[i].credits = scheduler.queues[i].weight;
+			
+		scheduler.currentClass = 0;
+	}
+	
+	return NULL;
+}
+
+/* A method for each scheduler worker, runs items until the scheduler is stopped */
+void *workerThread(void *args)
+{
+	WorkQueue *queue;
+	WorkItem *item;
+	int workClass;
+	
+	(void) args;
+	
+	pthread_mutex_lock(&scheduler.lock);
+	
+	while(TRUE)
+	{
+		item = dequeueWork(&workClass);
+		
+		if(item == NULL)
+		{
+			if(scheduler.shutdown)
+				break;
+				
+			pthread_cond_wait(&scheduler.workAvailable, &scheduler.lock);
+			continue;
+		}
+		
+		/* Record how long the item waited in its queue */
+		queue = &scheduler.queues[workClass];
+		
+		if(queue->numDelays == queue->delaysCapacity)
+		{
+			queue->delaysCapacity = queue->delaysCapacity == 0 ? 1024 : queue->delaysCapacity * 2;
+			queue->delays = (double *) realloc(queue->delays, queue->delaysCapacity * sizeof(double));
+		}
+		
+		queue->delays[queue->numDelays++] = now() - item->enqueueTime;
+		
+		pthread_mutex_unlock(&scheduler.lock);
+		item->run(item->arg);
+		pthread_mutex_lock(&scheduler.lock);
+		
+		scheduler.outstanding--;
+		
+		if(scheduler.outstanding == 0)
+			pthread_cond_broadcast(&scheduler.idle);
+	}
+	
+	pthread_mutex_unlock(&scheduler.lock);
+	
+	return (void *) NULL;
+}
+
+/* Start the worker pool, weights are the items per round of each class */
+void startScheduler(int numWorkers, const int *weights)
+{
+	const char *names[NUM_CLASSES] = { "interactive", "bulk", "maintenance" };
+	int i;
+	
+	memset(&scheduler, 0, sizeof(Scheduler));
+	pthread_mutex_init(&scheduler.lock, NULL);
+	pthread_cond_init(&scheduler.workAvailable, NULL);
+	pthread_cond_init(&scheduler.idle, NULL);
+	
+	for(i = 0; i < NUM_CLASSES; i++)
+	{
+		scheduler.queues[i].name = names[i];
+		scheduler.queues[i].weight = weights[i] > 0 ? weights[i] : 1;
+		scheduler.queues[i].credits = scheduler.queues[i].weight;
+	}
+	
+	scheduler.numWorkers = numWorkers;
+	scheduler.workers = (pthread_t *) malloc(numWorkers * sizeof(pthread_t));
+	
+	for(i = 0; i < numWorkers; i++)
+		pthread_create(&scheduler.workers[i], NULL, &workerThread, NULL);
+}
+
+/* Queue an item on a priority class */
+void submitWork(WorkItem *item, int workClass)
+{
+	WorkQueue *queue;
+	
+	item->next = NULL;
+	item->enqueueTime = now();
+	
+	pthread_mutex_lock(&scheduler.lock);
+	
+	queue = &scheduler.queues[workClass];
+	
+	if(queue->tail == NULL)
+		queue->head = item;
+	else
+		queue->tail->next = item;
+		
+	queue->tail = item;
+	queue->length++;
+	scheduler.outstanding++;
+	
+	pthread_cond_signal(&scheduler.workAvailable);
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/* Wait until every submitted item has run */
+void waitForScheduler()
+{
+	pthread_mutex_lock(&scheduler.lock);
+	
+	while(scheduler.outstanding > 0)
+		pthread_cond_wait(&scheduler.idle, &scheduler.lock);
+		
+	pthread_mutex_unlock(&scheduler.lock);
+}
+
+/* Let the workers drain the queues and exit */
+void stopScheduler()
+{
+	int i;
+	
+	pthread_mutex_lock(&scheduler.lock);
+	scheduler.shutdown = TRUE;
+	pthread_cond_broadcast(&scheduler.workAvailable);
+	pthread_mutex_unlock(&scheduler.lock);
+	
+	for(i = 0; i < scheduler.numWorkers; i++)
+		pthread_join(scheduler.workers[i], NULL);
+		
+	for(i = 0; i < NUM_CLASSES; i++)
+		free(scheduler.queues[i].delays);
+		
+	free(scheduler.workers);
+	pthread_cond_destroy(&scheduler.idle);
+	pthread_cond_destroy(&scheduler.workAvailable);
+	pthread_mutex_destroy(&scheduler.lock);
+}
+
+/* Compare two doubles for qsort */
+int compareDoubles(const void *a, const void *b)
+{
+	double x;
+	double y;
+	
+	x = *(const double *) a;
+	y = *(const double *) b;
+	
+	return (x > y) - (x < y);
+}
+
+/* Print the queueing delay percentiles of each class */
+void printSchedulerStats(FILE *outFile)
+{
+	WorkQueue *queue;
+	int i;
+	
+	for(i = 0; i < NUM_CLASSES; i++)
+	{
+		queue = &scheduler.queues[i];
+		
+		if(queue->numDelays == 0)
+			continue;
+			
+		qsort(queue->delays, queue->numDelays, sizeof(double), &compareDoubles);
+		
+		fprintf(outFile, "Queue %-11s  %8d items  weight %2d  delay p50 %9.3f ms  p99 %9.3f ms  max %9.3f ms\n",
+			queue->name, queue->numDelays, queue->weight,
+			queue->delays[(queue->numDelays - 1) / 2] * 1e3,
+			queue->delays[(int) ((queue->numDelays - 1) * 0.99)] * 1e3,
+			queue->delays[queue->numDelays - 1] * 1e3);
+	}
+}
+
+/* The most a withdrawal of the amount can be charged by an account of a type */
+int64_t largestWithdrawalFees(const FeeSchedule *schedule, int64_t amount)
+{
+	return (int64_t) schedule->withdrawalFee + (schedule->transactionFee > 0 ? schedule->transactionFee : 0)
+		+ (amount / 500 + 1) * (schedule->overdraftFee > 0 ? schedule->overdraftFee : 0);
+}
+
+/* Whether a withdrawal of the amount and its fees stay in an int for every account type,
+the fees are ints and the four lane kernel prices the overdraft fee in 32 bit lanes */
+int withdrawalFits(int64_t amount)
+{
+	unsigned int i;
+	
+	for(i = 0; i < feeSchedulesList.numSchedules; i++)
+	{
+		if(amount + largestWithdrawalFees(&feeSchedulesList.schedules[i], amount) > INT32_MAX)
+			return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/* Price and apply withdrawals lanes first to last without branches, one lane at a time.
+The sums are taken in 64 bits like the lanes of the vectorized kernel take them */
+void priceWithdrawalRange(WithdrawalBatch *batch, unsigned int first, unsigned int last)
+{
+	const FeeSchedule *schedule;
+	int64_t balance;
+	int64_t amount;
+	int64_t fees;
+	int64_t overdraftFees;
+	int covered;
+	int accepted;
+	unsigned int i;
+	
+	for(i = first; i < last; i++)
+	{
+		schedule = &feeSchedulesList.schedules[batch->feeSchedules[i]];
+		balance = batch->balances[i];
+		amount = batch->amounts[i];
+		fees = (int64_t) schedule->withdrawalFee + (batch->numTransactions[i] > schedule->transactionFeeThreshold ? schedule->transactionFee : 0);
+		overdraftFees = ((amount / 500) + 1) * schedule->overdraftFee;
+		covered = balance >= amount + fees;
+		accepted = covered | ((batch->flags[i] & ACCOUNT_OVERDRAFT_PROTECTED) && balance - fees - overdraftFees - amount >= -5000);
+		fees += covered ? 0 : overdraftFees;
+		
+		batch->balances[i] = balance - (accepted ? amount + fees : 0);
+		batch->numTransactions[i] += accepted;
+		batch->fees[i] = accepted ? (int) fees : 0;
+		batch->accepted[i] = (unsigned char) accepted;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* The same four lanes at a time. The fees are gathered from the fee schedules, the $500
+steps of the overdraft fee come from a truncated double division, which is exact for
+any int amount, and the balances are compared as 64 bit lanes */
+__attribute__((target("avx2")))
+void priceWithdrawalsAvx2(WithdrawalBatch *batch)
+{
+	const int *schedules;
+	__m128i index;
+	__m128i withdrawalFee;
+	__m128i transactionFee;
+	__m128i threshold;
+	__m128i overdraftFee;
+	__m128i numTransactions;
+	__m128i amount;
+	__m128i fees;
+	__m128i overdraftFees;
+	__m128i protectedLanes;
+	__m128i accepted32;
+	__m256i balance;
+	__m256i amount64;
+	__m256i fees64;
+	__m256i overdraftFees64;
+	__m256i uncovered;
+	__m256i belowFloor;
+	__m256i accepted;
+	__m256i charged;
+	uint32_t flags;
+	unsigned int i;
+	
+	schedules = (const int *) feeSchedulesList.schedules;
+	
+	for(i = 0; i + 4 <= batch->count; i += 4)
+	{
+		index = _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) (batch->feeSchedules + i))),
+			_mm_set1_epi32(sizeof(FeeSchedule) / sizeof(int)));
+		withdrawalFee = _mm_i32gather_epi32(schedules + offsetof(FeeSchedule, withdrawalFee) / sizeof(int), index, 4);
+		transactionFee = _mm_i32gather_epi32(schedules + offsetof(FeeSchedule, transactionFee) / sizeof(int), index, 4);
+		threshold = _mm_i32gather_epi32(schedules + offsetof(FeeSchedule, transactionFeeThreshold) / sizeof(int), index, 4);
+		overdraftFee = _mm_i32gather_epi32(schedules + offsetof(FeeSchedule, overdraftFee) / sizeof(int), index, 4);
+		
+		numTransactions = _mm_loadu_si128((const __m128i *) (batch->numTransactions + i));
+		amount = _mm_loadu_si128((const __m128i *) (batch->amounts + i));
+		memcpy(&flags, batch->flags + i, sizeof(flags));
+		protectedLanes = _mm_cmpgt_epi32(_mm_and_si128(_mm_cvtepu8_epi32(_mm_cvtsi32_si128((int) flags)),
+			_mm_set1_epi32(ACCOUNT_OVERDRAFT_PROTECTED)), _mm_setzero_si128());
+		
+		fees = _mm_add_epi32(withdrawalFee, _mm_and_si128(_mm_cmpgt_epi32(numTransactions, threshold), transactionFee));
+		overdraftFees = _mm_mullo_epi32(_mm_add_epi32(_mm256_cvttpd_epi32(_mm256_div_pd(_mm256_cvtepi32_pd(amount), _mm256_set1_pd(500.0))),
+			_mm_set1_epi32(1)), overdraftFee);
+		
+		balance = _mm256_loadu_si256((const __m256i *) (batch->balances + i));
+		amount64 = _mm256_cvtepi32_epi64(amount);
+		fees64 = _mm256_cvtepi32_epi64(fees);
+		overdraftFees64 = _mm256_cvtepi32_epi64(overdraftFees);
+		
+		uncovered = _mm256_cmpgt_epi64(_mm256_add_epi64(amount64, fees64), balance);
+		belowFloor = _mm256_cmpgt_epi64(_mm256_set1_epi64x(-5000),
+			_mm256_sub_epi64(balance, _mm256_add_epi64(_mm256_add_epi64(fees64, overdraftFees64), amount64)));
+		accepted = _mm256_andnot_si256(_mm256_and_si256(uncovered, _mm256_or_si256(belowFloor,
+			_mm256_xor_si256(_mm256_cvtepi32_epi64(protectedLanes), _mm256_set1_epi64x(-1)))), _mm256_set1_epi64x(-1));
+		fees64 = _mm256_add_epi64(fees64, _mm256_and_si256(uncovered, overdraftFees64));
+		charged = _mm256_and_si256(accepted, _mm256_add_epi64(amount64, fees64));
+		_mm256_storeu_si256((__m256i *) (batch->balances + i), _mm256_sub_epi64(balance, charged));
+		
+		/* The low halves of the 64 bit lanes hold the masks and fees as 32 bit lanes */
+		accepted32 = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(accepted, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)));
+		fees = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(fees64, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7)));
+		_mm_storeu_si128((__m128i *) (batch->numTransactions + i), _mm_sub_epi32(numTransactions, accepted32));
+		_mm_storeu_si128((__m128i *) (batch->fees + i), _mm_and_si128(accepted32, fees));
+		
+		flags = (uint32_t) _mm_cvtsi128_si32(_mm_and_si128(_mm_packs_epi16(_mm_packs_epi32(accepted32, accepted32), accepted32), _mm_set1_epi8(1)));
+		memcpy(batch->accepted + i, &flags, sizeof(flags));
+	}
+	
+	priceWithdrawalRange(batch, i, batch->count);
+}
+#endif
+
+/* Price and apply a batch of withdrawals, each on a different account. A withdrawal is
+taken and charged exactly as withdrawFromAccount would take and charge it, by the scalar
+loop on processors without AVX2 */
+void priceWithdrawals(WithdrawalBatch *batch)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(useAvx2)
+	{
+		priceWithdrawalsAvx2(batch);
+		return;
+	}
+#endif
+
+	priceWithdrawalRange(batch, 0, batch->count);
+}
+
+/* Point a batch at the columns of an account block */
+void withdrawalBatchOfBlock(WithdrawalBatch *batch, AccountBlock *block, const int *amounts, int *fees, unsigned char *accepted)
+{
+	batch->balances = block->balances;
+	batch->numTransactions = block->numTransactions;
+	batch->feeSchedules = block->feeSchedules;
+	batch->flags = block->flags;
+	batch->amounts = amounts;
+	batch->fees = fees;
+	batch->accepted = accepted;
+	batch->count = ACCOUNTS_PER_BLOCK;
+}
+
+/* Apply a maintenance operation to the first count accounts of a block. The loops only
+use the column arrays and selects, so the compiler can vectorize them */
+void runBatchOnBlock(AccountBlock *block, int count, const BatchOperation *operation)
+{
+	WithdrawalBatch batch;
+	int amounts[ACCOUNTS_PER_BLOCK];
+	int fees[ACCOUNTS_PER_BLOCK];
+	unsigned char accepted[ACCOUNTS_PER_BLOCK];
+	int64_t balance;
+	int64_t penalty;
+	int closed;
+	int j;
+	
+	if(operation->operation == BATCH_MONTHLY_FEES)
+	{
+		/* Closed slots hold a zero balance, the other passes leave that alone */
+		for(j = 0; j < count; j++)
+			block->balances[j] -= (block->flags[j] & ACCOUNT_CLOSED) ? 0 : batchMonthlyFees[block->feeSchedules[j]];
+	}
+	else if(operation->operation == BATCH_INTEREST)
+	{
+		/* Interest in basis points, only positive balances earn it */
+		for(j = 0; j < count; j++)
+		{
+			balance = block->balances[j];
+			block->balances[j] = balance + (balance > 0 ? balance * operation->parameter / 10000 : 0);
+		}
+	}
+	else if(operation->operation == BATCH_RESET_COUNTERS)
+	{
+		for(j = 0; j < count; j++)
+			block->numTransactions[j] = 0;
+	}
+	else if(operation->operation == BATCH_OVERDRAFT_SWEEP)
+	{
+		/* Overdrawn protected accounts pay the overdraft fee for every $500 they are in debt */
+		for(j = 0; j < count; j++)
+		{
+			balance = block->balances[j];
+			penalty = (-balance / 500 + 1) * batchOverdraftFees[block->feeSchedules[j]];
+			block->balances[j] = balance - ((balance < 0 && (block->flags[j] & ACCOUNT_OVERDRAFT_PROTECTED)) ? penalty : 0);
+		}
+	}
+	else if(operation->operation == BATCH_WITHDRAWAL)
+	{
+		/* A standing withdrawal from every account, priced by the fee kernel. The kernel
+		has no mask, so whatever it took from a closed slot is put back afterwards */
+		for(j = 0; j < count; j++)
+			amounts[j] = (int) operation->parameter;
+			
+		withdrawalBatchOfBlock(&batch, block, amounts, fees, accepted);
+		batch.count = count;
+		priceWithdrawals(&batch);
+		
+		for(j = 0; j < count; j++)
+		{
+			closed = (block->flags[j] & ACCOUNT_CLOSED) != 0;
+			block->balances[j] += closed ? ((int64_t) amounts[j] + fees[j]) * accepted[j] : 0;
+			block->numTransactions[j] -= closed ? accepted[j] : 0;
+		}
+	}
+}
+
+/* A random int from low to high */
+int fuzzInt(int low, int high)
+{
+	return low + (int) (((double) rand() / ((double) RAND_MAX + 1)) * (high - low + 1));
+}
+
+/* Run random withdrawals through withdrawFromAccount and through the batch kernel, scalar
+and vectorized, and compare every balance, count and charge. Accounts get random fees and
+overdraft protection, balances are picked around the point where a withdrawal stops being
+covered and around the -5000 floor as often as at random. Returns the number of mismatches */
+unsigned int fuzzWithdrawals(unsigned int numWithdrawals, unsigned int seed)
+{
+	AccountBlock *block;
+	AccountBlock *scalarBlock;
+	AccountBlock *vectorBlock;
+	WithdrawalBatch batch;
+	FeeSchedule *schedule;
+	int amounts[ACCOUNTS_PER_BLOCK];
+	int scalarFees[ACCOUNTS_PER_BLOCK];
+	int vectorFees[ACCOUNTS_PER_BLOCK];
+	unsigned char scalarAccepted[ACCOUNTS_PER_BLOCK];
+	unsigned char vectorAccepted[ACCOUNTS_PER_BLOCK];
+	char line[256];
+	double times[3];
+	double startTime;
+	unsigned int numMismatches;
+	unsigned int numRounds;
+	unsigned int numAccepted;
+	unsigned int round;
+	unsigned int i;
+	int64_t before;
+	int64_t fees;
+	int j;
+	
+	srand(seed);
+	verbose = FALSE;
+	
+	/* One block of accounts with every kind of fee schedule */
+	for(i = 0; i < ACCOUNTS_PER_BLOCK; i++)
+	{
+		snprintf(line, sizeof(line), "f%u type fuzz%u d 0 w %d t 0 transactions %d %d overdraft %s %d", i, i % 32,
+			fuzzInt(0, 20), fuzzInt(0, 10), fuzzInt(0, 10), fuzzInt(0, 2) > 0 ? "Y" : "N", fuzzInt(0, 100));
+		addAccount(line);
+	}
+	
+	reserveAccounts(0);
+	block = &accountsList.blocks[0];
+	scalarBlock = (AccountBlock *) malloc(sizeof(AccountBlock));
+	vectorBlock = (AccountBlock *) malloc(sizeof(AccountBlock));
+	numRounds = (numWithdrawals + ACCOUNTS_PER_BLOCK - 1) / ACCOUNTS_PER_BLOCK;
+	numMismatches = 0;
+	numAccepted = 0;
+	memset(times, 0, sizeof(times));
+	
+	for(round = 0; round < numRounds; round++)
+	{
+		for(j = 0; j < ACCOUNTS_PER_BLOCK; j++)
+		{
+			schedule = &feeSchedulesList.schedules[block->feeSchedules[j]];
+			/* Amounts go as high as an int holds with the fees of the account on top, the
+			most -e withdraw takes */
+			if(fuzzInt(0, 7) == 0)
+				amounts[j] = INT32_MAX - (int) largestWithdrawalFees(schedule, INT32_MAX) - fuzzInt(0, 1000);
+			else
+				amounts[j] = fuzzInt(0, 3) == 0 ? fuzzInt(0, 10) : fuzzInt(0, 6000);
+				
+			block->numTransactions[j] = fuzzInt(0, 12);
+			fees = (int64_t) schedule->withdrawalFee + (block->numTransactions[j] > schedule->transactionFeeThreshold ? schedule->transactionFee : 0);
+			
+			if(fuzzInt(0, 2) == 0)
+				block->balances[j] = (int64_t) amounts[j] * fuzzInt(-1, 1) + fuzzInt(-7000, 7000);
+			else if(fuzzInt(0, 1) == 0)
+				block->balances[j] = amounts[j] + fees + fuzzInt(-1, 1);
+			else
+				block->balances[j] = -5000 + amounts[j] + fees + ((amounts[j] / 500) + 1) * schedule->overdraftFee + fuzzInt(-1, 1);
+		}
+		
+		memcpy(scalarBlock, block, sizeof(AccountBlock));
+		memcpy(vectorBlock, block, sizeof(AccountBlock));
+		
+		startTime = now();
+		
+		for(j = 0; j < ACCOUNTS_PER_BLOCK; j++)
+			withdrawFromAccount(j, amounts[j]);
+			
+		times[0] += now() - startTime;
+		
+		withdrawalBatchOfBlock(&batch, scalarBlock, amounts, scalarFees, scalarAccepted);
+		startTime = now();
+		priceWithdrawalRange(&batch, 0, batch.count);
+		times[1] += now() - startTime;
+		
+		withdrawalBatchOfBlock(&batch, vectorBlock, amounts, vectorFees, vectorAccepted);
+		startTime = now();
+		priceWithdrawals(&batch);
+		times[2] += now() - startTime;
+		
+		for(j = 0; j < ACCOUNTS_PER_BLOCK; j++)
+		{
+			before = scalarBlock->balances[j] + scalarFees[j] + (scalarAccepted[j] ? amounts[j] : 0);
+			numAccepted += scalarAccepted[j];
+			
+			if(block->balances[j] == scalarBlock->balances[j] && block->numTransactions[j] == scalarBlock->numTransactions[j]
+				&& scalarBlock->balances[j] == vectorBlock->balances[j] && scalarBlock->numTransactions[j] == vectorBlock->numTransactions[j]
+				&& scalarFees[j] == vectorFees[j] && scalarAccepted[j] == vectorAccepted[j])
+				continue;
+				
+			if(numMismatches++ < 10)
+			{
+				fprintf(stderr, "Mismatch: balance %" PRId64 ", %d transactions, withdrawing %d from %s gives %" PRId64 "/%d, the kernel %" PRId64 "/%d scalar and %" PRId64 "/%d %s\n",
+					before, block->numTransactions[j] - scalarAccepted[j], amounts[j], accountId(j),
+					block->balances[j], block->numTransactions[j], scalarBlock->balances[j], scalarBlock->numTransactions[j],
+					vectorBlock->balances[j], vectorBlock->numTransactions[j], useAvx2 ? "avx2" : "scalar");
+			}
+		}
+	}
+	
+	fprintf(stderr, "Fuzz:    %u withdrawals, %u taken, %u mismatches; withdrawFromAccount %.1f M/s, kernel %.1f M/s scalar, %.1f M/s %s\n",
+		numRounds * ACCOUNTS_PER_BLOCK, numAccepted, numMismatches,
+		numRounds * ACCOUNTS_PER_BLOCK / 1e6 / (times[0] > 0 ? times[0] : 1e-9),
+		numRounds * ACCOUNTS_PER_BLOCK / 1e6 / (times[1] > 0 ? times[1] : 1e-9),
+		numRounds * ACCOUNTS_PER_BLOCK / 1e6 / (times[2] > 0 ? times[2] : 1e-9), useAvx2 ? "avx2" : "scalar");
+	
+	free(scalarBlock);
+	free(vectorBlock);
+	
+	return numMismatches;
+}
+
+/* Mark the accounts of a block whose balance a maintenance pass changed, with a single
+append to the change list for the whole block */
+void markBlockDirty(AccountBlock *block, unsigned int blockIndex, const int64_t *before, int count)
+{
+	DirtyEntry entries[ACCOUNTS_PER_BLOCK];
+	unsigned int index;
+	unsigned int numEntries;
+	uint64_t bit;
+	int j;
+	
+	numEntries = 0;
+	
+	for(j = 0; j < count; j++)
+	{
+		if(block->balances[j] == before[j])
+			continue;
+			
+		index = blockIndex * ACCOUNTS_PER_BLOCK + j;
+		bit = (uint64_t) 1 << (index % 64);
+		
+		if(__atomic_fetch_or(&dirtyTracker.bits[index / 64], bit, __ATOMIC_RELAXED) & bit)
+			continue;
+			
+		entries[numEntries].index = index;
+		entries[numEntries].before = before[j];
+		numEntries++;
+	}
+	
+	if(numEntries > 0)
+		appendDirtyEntries(entries, numEntries);
+}
+
+/* Run a maintenance operation over a range of blocks */
+void runBatchPartition(void *arg)
+{
+	BatchPartition *partition;
+	AccountBlock *block;
+	int64_t before[ACCOUNTS_PER_BLOCK];
+	unsigned int i;
+	unsigned int count;
+	
+	partition = (BatchPartition *) arg;
+	
+	for(i = partition->firstBlock; i < partition->endBlock; i++)
+	{
+		count = accountsList.numAccounts - i * ACCOUNTS_PER_BLOCK;
+		
+		if(count > ACCOUNTS_PER_BLOCK)
+			count = ACCOUNTS_PER_BLOCK;
+			
+		block = pinAccountBlock(i * ACCOUNTS_PER_BLOCK, TRUE);
+		
+		if(dirtyTracker.enabled)
+			memcpy(before, block->balances, count * sizeof(int64_t));
+			
+		runBatchOnBlock(block, count, partition->operation);
+		
+		if(dirtyTracker.enabled)
+			markBlockDirty(block, i, before, count);
+			
+		unpinAccountBlock(i * ACCOUNTS_PER_BLOCK);
+	}
+}
+
+/* Thread wrapper around runBatchPartition */
+void *batchPartitionThread(void *args)
+{
+	runBatchPartition(args);
+	
+	return (void *) NULL;
+}
+
+/* Run a maintenance operation over every account in parallel. No transaction may be
+running, so the passes go without the account locks. The partitions go through the
+maintenance class when the scheduler is running, otherwise they get their own threads */
+void runBatchOperation(const BatchOperation *operation, int numThreads)
+{
+	BatchPartition *partitions;
+	unsigned int numBlocks;
+	unsigned int i;
+	
+	numBlocks = (accountsList.numAccounts + ACCOUNTS_PER_BLOCK - 1) / ACCOUNTS_PER_BLOCK;
+	
+	if(numBlocks == 0)
+		return;
+	
+	if(scheduler.numWorkers > 0)
+		numThreads = scheduler.numWorkers;
+		
+	if((unsigned int) numThreads > numBlocks)
+		numThreads = numBlocks;
+		
+	/* Gather the fee schedule values the passes need */
+	batchMonthlyFees = (int64_t *) malloc(feeSchedulesList.numSchedules * sizeof(int64_t));
+	batchOverdraftFees = (int64_t *) malloc(feeSchedulesList.numSchedules * sizeof(int64_t));
+	
+	for(i = 0; i < feeSchedulesList.numSchedules; i++)
+	{
+		batchMonthlyFees[i] = feeSchedulesList.schedules[i].monthlyFee;
+		batchOverdraftFees[i] = feeSchedulesList.schedules[i].overdraftFee;
+	}
+	
+	partitions = (BatchPartition *) calloc(numThreads, sizeof(BatchPartition));
+	
+	for(i = 0; i < (unsigned int) numThreads; i++)
+	{
+		partitions[i].operation = operation;
+		partitions[i].firstBlock = numBlocks * i / numThreads;
+		partitions[i].endBlock = numBlocks * (i + 1) / numThreads;
+		
+		if(scheduler.numWorkers > 0)
+		{
+			partitions[i].work.run = &runBatchPartition;
+			partitions[i].work.arg = &partitions[i];
+			submitWork(&partitions[i].work, CLASS_MAINTENANCE);
+		}
+		else if(i > 0)
+			pthread_create(&partitions[i].thread, NULL, &batchPartitionThread, &partitions[i]);
+	}
+	
+	if(scheduler.numWorkers > 0)
+		waitForScheduler();
+	else
+	{
+		/* The calling thread takes the first partition itself */
+		runBatchPartition(&partitions[0]);
+		
+		for(i = 1; i < (unsigned int) numThreads; i++)
+			pthread_join(partitions[i].thread, NULL);
+	}
+	
+	free(partitions);
+	free(batchMonthlyFees);
+	free(batchOverdraftFees);
+}
+
+/* Parse a list like "interest=25,fees,overdraft,reset", returns the number of operations or -1 */
+int parseBatchOperations(char *list, BatchOperation *operations)
+{
+	const char *names[] = { "fees", "interest", "reset", "overdraft", "withdraw" };
+	char *token;
+	char *savePtr;
+	char *value;
+	int numOperations;
+	int i;
+	
+	numOperations = 0;
+	
+	for(token = strtok_r(list, ",", &savePtr); token != NULL; token = strtok_r(NULL, ",", &savePtr))
+	{
+		if(numOperations == MAX_BATCH_OPERATIONS)
+			return -1;
+			
+		value = strchr(token, '=');
+		
+		if(value != NULL)
+			*value++ = '\0';
+		
+		for(i = 0; i < 5 && strcmp(token, names[i]) != 0; i++)
+			;
+			
+		if(i == 5)
+			return -1;
+			
+		/* A withdrawal needs an amount the kernel can take as an int */
+		if(i == BATCH_WITHDRAWAL && (value == NULL || atoll(value) <= 0 || atoll(value) > INT32_MAX))
+			return -1;
+			
+		operations[numOperations].operation = i;
+		operations[numOperations].parameter = value != NULL ? atoll(value) : 0;
+		numOperations++;
+	}
+	
+	return numOperations;
+}
+
+/* Name of a maintenance operation */
+const char *batchOperationName(const BatchOperation *operation)
+{
+	const char *names[] = { "fees", "interest", "reset", "overdraft", "withdraw" };
+	
+	return names[operation->operation];
+}
+
+/* Start recording the lock order of every job */
+void startTracing()
+{
+	tracer.records = (TraceRecord *) calloc(transactionsList.numJobs + 1, sizeof(TraceRecord));
+	tracer.sequence = 0;
+	tracer.startTime = nowNs();
+	tracer.enabled = TRUE;
+}
+
+/* Compare two job numbers by the ticket their jobs took, for qsort */
+int compareTraceTickets(const void *a, const void *b)
+{
+	uint64_t x;
+	uint64_t y;
+	
+	x = tracer.records[*(const unsigned int *) a].sequence;
+	y = tracer.records[*(const unsigned int *) b].sequence;
+	
+	return (x > y) - (x < y);
+}
+
+/* Number the tickets 0 to numJobs - 1 in the order they were taken. A job whose account
+was opened while it looked it up took a ticket for the miss and another one under its
+lock, it keeps the second and the first leaves a gap */
+void rankTraceTickets()
+{
+	unsigned int *order;
+	unsigned int i;
+	
+	if(tracer.sequence == transactionsList.numJobs)
+		return;
+		
+	order = (unsigned int *) malloc((transactionsList.numJobs + 1) * sizeof(unsigned int));
+	
+	for(i = 0; i < transactionsList.numJobs; i++)
+		order[i] = i;
+		
+	qsort(order, transactionsList.numJobs, sizeof(unsigned int), &compareTraceTickets);
+	
+	for(i = 0; i < transactionsList.numJobs; i++)
+		tracer.records[order[i]].sequence = i;
+		
+	free(order);
+}
+
+/* Write the recorded trace, returns FALSE if the file cannot be written */
+int writeTrace(const char *path)
+{
+	TraceHeader header;
+	FILE *file;
+	int ok;
+	
+	file = fopen(path, "wb");
+	
+	if(file == NULL)
+		return FALSE;
+		
+	memset(&header, 0, sizeof(TraceHeader));
+	memcpy(header.magic, "ASN3TRC1", 8);
+	header.numAccounts = directory.numNames;
+	header.numTransactions = transactionsList.numTransactions;
+	header.numJobs = transactionsList.numJobs;
+	rankTraceTickets();
+	
+	ok = fwrite(&header, sizeof(TraceHeader), 1, file) == 1 &&
+		fwrite(tracer.records, sizeof(TraceRecord), transactionsList.numJobs, file) == transactionsList.numJobs;
+	ok = fclose(file) == 0 && ok;
+	
+	return ok;
+}
+
+/* Stop recording */
+void stopTracing()
+{
+	free(tracer.records);
+	tracer.records = NULL;
+	tracer.enabled = FALSE;
+}
+
+/* Load a trace recorded from the same input, returns FALSE if it does not belong to it */
+int loadTrace(const char *path)
+{
+	TraceHeader header;
+	FILE *file;
+	unsigned int i;
+	int ok;
+	
+	file = fopen(path, "rb");
+	
+	if(file == NULL)
+		return FALSE;
+		
+	ok = fread(&header, sizeof(TraceHeader), 1, file) == 1 &&
+		memcmp(header.magic, "ASN3TRC1", 8) == 0 &&
+		header.numAccounts == directory.numNames &&
+		header.numTransactions == (uint32_t) transactionsList.numTransactions &&
+		header.numJobs == transactionsList.numJobs;
+	
+	if(ok)
+	{
+		tracer.records = (TraceRecord *) malloc((transactionsList.numJobs + 1) * sizeof(TraceRecord));
+		ok = fread(tracer.records, sizeof(TraceRecord), transactionsList.numJobs, file) == transactionsList.numJobs;
+	}
+	
+	fclose(file);
+	
+	if(!ok)
+		return FALSE;
+		
+	/* Every job got a distinct ticket, so the tickets are a permutation of the job numbers */
+	replay.order = (unsigned int *) malloc((transactionsList.numJobs + 1) * sizeof(unsigned int));
+	memset(replay.order, 0xFF, (transactionsList.numJobs + 1) * sizeof(unsigned int));
+	
+	for(i = 0; i < transactionsList.numJobs; i++)
+	{
+		if(tracer.records[i].sequence >= transactionsList.numJobs || replay.order[tracer.records[i].sequence] != ACCOUNT_NONE)
+			return FALSE;
+			
+		replay.order[tracer.records[i].sequence] = i;
+	}
+	
+	return TRUE;
+}
+
+/* The job with a given number */
+Job *jobOf(unsigned int jobNumber)
+{
+	Transaction *transaction;
+	
+	transaction = &transactionsList.transactions[replay.jobTransaction[jobNumber]];
+	
+	return &transaction->jobs[jobNumber - transaction->jobBase];
+}
+
+/* A method for each replay thread, takes jobs in trace order and runs each one as soon as
+every earlier job on its accounts has run */
+void *replayThread(void *args)
+{
+	Transaction *transaction;
+	Job *job;
+	unsigned int jobNumber;
+	unsigned int k;
+	
+	(void) args;
+	
+	while((k = __atomic_fetch_add(&replay.next, 1, __ATOMIC_RELAXED)) < transactionsList.numJobs)
+	{
+		jobNumber = replay.order[k];
+		job = jobOf(jobNumber);
+		transaction = &transactionsList.transactions[replay.jobTransaction[jobNumber]];
+		
+		while(__atomic_load_n(&replay.applied[job->fromAccount], __ATOMIC_ACQUIRE) != replay.fromPosition[jobNumber])
+			sched_yield();
+			
+		while(job->type == 't' && __atomic_load_n(&replay.applied[job->toAccount], __ATOMIC_ACQUIRE) != replay.toPosition[jobNumber])
+			sched_yield();
+			
+		executeJob(transaction, job);
+		
+		__atomic_store_n(&replay.applied[job->fromAccount], replay.fromPosition[jobNumber] + 1, __ATOMIC_RELEASE);
+		
+		if(job->type == 't')
+			__atomic_store_n(&replay.applied[job->toAccount], replay.toPosition[jobNumber] + 1, __ATOMIC_RELEASE);
+	}
+	
+	return (void *) NULL;
+}
+
+/* Re-run the jobs in the order of a loaded trace. With one thread this is the recorded
+order exactly, with more the jobs on different accounts overlap but each account still
+sees its jobs in the recorded order, which gives the same balances */
+void replayTrace(int numThreads)
+{
+	pthread_t *threads;
+	unsigned int *counts;
+	unsigned int jobNumber;
+	unsigned int i;
+	int j;
+	Job *job;
+	
+	replay.jobTransaction = (unsigned int *) malloc((transactionsList.numJobs + 1) * sizeof(unsigned int));
+	replay.fromPosition = (unsigned int *) malloc((transactionsList.numJobs + 1) * sizeof(unsigned int));
+	replay.toPosition = (unsigned int *) malloc((transactionsList.numJobs + 1) * sizeof(unsigned int));
+	replay.applied = (unsigned int *) calloc(directory.numNames + 1, sizeof(unsigned int));
+	replay.next = 0;
+	counts = (unsigned int *) calloc(directory.numNames + 1, sizeof(unsigned int));
+	
+	for(i = 0; i < (unsigned int) transactionsList.numTransactions; i++)
+	{
+		for(j = 0; j < transactionsList.transactions[i].numJobs; j++)
+			replay.jobTransaction[transactionsList.transactions[i].jobBase + j] = i;
+	}
+	
+	/* Position of each job among the jobs on the same account */
+	for(i = 0; i < transactionsList.numJobs; i++)
+	{
+		jobNumber = replay.order[i];
+		job = jobOf(jobNumber);
+		replay.fromPosition[jobNumber] = counts[job->fromAccount]++;
+		
+		if(job->type == 't')
+			replay.toPosition[jobNumber] = counts[job->toAccount]++;
+	}
+	
+	free(counts);
+	
+	if(numThreads < 1)
+		numThreads = 1;
+		
+	threads = (pthread_t *) malloc(numThreads * sizeof(pthread_t));
+	
+	for(j = 1; j < numThreads; j++)
+		pthread_create(&threads[j], NULL, &replayThread, NULL);
+		
+	replayThread(NULL);
+	
+	for(j = 1; j < numThreads; j++)
+		pthread_join(threads[j], NULL);
+		
+	free(threads);
+}
+
+/* Report where the time of the traced run went. The critical path is the longest chain of
+lock hold times, where a job follows the previous job on each of its accounts and the
+previous job of its own transaction */
+void printCriticalPath(FILE *outFile)
+{
+	uint64_t *finish;
+	uint64_t *accountTime;
+	unsigned int *previous;
+	unsigned int *lastOnAccount;
+	unsigned int *touched;
+	unsigned int numTouched;
+	unsigned int jobNumber;
+	unsigned int predecessor;
+	unsigned int last;
+	unsigned int pathJobs;
+	unsigned int best;
+	unsigned int i;
+	int k;
+	uint64_t start;
+	uint64_t totalHold;
+	uint64_t totalWait;
+	uint64_t firstAcquire;
+	uint64_t lastRelease;
+	Job *job;
+	
+	if(transactionsList.numJobs == 0)
+		return;
+		
+	finish = (uint64_t *) malloc(transactionsList.numJobs * sizeof(uint64_t));
+	previous = (unsigned int *) malloc(transactionsList.numJobs * sizeof(unsigned int));
+	lastOnAccount = (unsigned int *) malloc((directory.numNames + 1) * sizeof(unsigned int));
+	memset(lastOnAccount, 0xFF, (directory.numNames + 1) * sizeof(unsigned int));
+	
+	totalHold = 0;
+	totalWait = 0;
+	firstAcquire = UINT64_MAX;
+	lastRelease = 0;
+	last = replay.order[0];
+	
+	/* Trace order is a topological order of the dependencies */
+	for(i = 0; i < transactionsList.numJobs; i++)
+	{
+		jobNumber = replay.order[i];
+		job = jobOf(jobNumber);
+		start = 0;
+		predecessor = ACCOUNT_NONE;
+		
+		if(jobNumber > transactionsList.transactions[replay.jobTransaction[jobNumber]].jobBase && finish[jobNumber - 1] > start)
+		{
+			start = finish[jobNumber - 1];
+			predecessor = jobNumber - 1;
+		}
+		
+		if(lastOnAccount[job->fromAccount] != ACCOUNT_NONE && finish[lastOnAccount[job->fromAccount]] > start)
+		{
+			start = finish[lastOnAccount[job->fromAccount]];
+			predecessor = lastOnAccount[job->fromAccount];
+		}
+		
+		if(job->type == 't' && lastOnAccount[job->toAccount] != ACCOUNT_NONE && finish[lastOnAccount[job->toAccount]] > start)
+		{
+			start = finish[lastOnAccount[job->toAccount]];
+			predecessor = lastOnAccount[job->toAccount];
+		}
+		
+		finish[jobNumber] = start + tracer.records[jobNumber].holdTime;
+		previous[jobNumber] = predecessor;
+		lastOnAccount[job->fromAccount] = jobNumber;
+		
+		if(job->type == 't')
+			lastOnAccount[job->toAccount] = jobNumber;
+			
+		if(finish[jobNumber] > finish[last])
+			last = jobNumber;
+			
+		totalHold += tracer.records[jobNumber].holdTime;
+		totalWait += tracer.records[jobNumber].waitTime;
+		
+		if(tracer.records[jobNumber].acquireTime < firstAcquire)
+			firstAcquire = tracer.records[jobNumber].acquireTime;
+			
+		if(tracer.records[jobNumber].acquireTime + tracer.records[jobNumber].holdTime > lastRelease)
+			lastRelease = tracer.records[jobNumber].acquireTime + tracer.records[jobNumber].holdTime;
+	}
+	
+	/* Walk the path back and charge its time to the accounts on it */
+	accountTime = (uint64_t *) calloc(directory.numNames + 1, sizeof(uint64_t));
+	touched = lastOnAccount;
+	numTouched = 0;
+	pathJobs = 0;
+	
+	for(jobNumber = last; jobNumber != ACCOUNT_NONE; jobNumber = previous[jobNumber])
+	{
+		job = jobOf(jobNumber);
+		
+		if(accountTime[job->fromAccount] == 0)
+			touched[numTouched++] = job->fromAccount;
+			
+		accountTime[job->fromAccount] += tracer.records[jobNumber].holdTime + 1;
+		
+		if(job->type == 't')
+		{
+			if(accountTime[job->toAccount] == 0)
+				touched[numTouched++] = job->toAccount;
+				
+			accountTime[job->toAccount] += tracer.records[jobNumber].holdTime + 1;
+		}
+		
+		pathJobs++;
+	}
+	
+	fprintf(outFile, "Trace:   %u jobs, %.3f ms from first lock to last release\n", 
+		transactionsList.numJobs, (lastRelease - firstAcquire) / 1e6);
+	fprintf(outFile, "Locks:   %.3f ms held, %.3f ms waited for in total\n", totalHold / 1e6, totalWait / 1e6);
+	fprintf(outFile, "Critical path: %.3f ms over %u jobs, available parallelism %.1f\n", 
+		finish[last] / 1e6, pathJobs, finish[last] > 0 ? (double) totalHold / finish[last] : 1.0);
+		
+	/* The accounts that hold up the critical path the most */
+	for(k = 0; k < 5 && numTouched > 0; k++)
+	{
+		best = 0;
+		
+		for(i = 1; i < numTouched; i++)
+		{
+			if(accountTime[touched[i]] > accountTime[touched[best]])
+				best = i;
+		}
+		
+		fprintf(outFile, "    %-12s %10.3f ms on the critical path\n", accountName(touched[best]), accountTime[touched[best]] / 1e6);
+		touched[best] = touched[--numTouched];
+	}
+	
+	free(accountTime);
+	free(lastOnAccount);
+	free(previous);
+	free(finish);
+}
+
+/* Release the replay state */
+void stopReplay()
+{
+	free(replay.order);
+	free(replay.jobTransaction);
+	free(replay.fromPosition);
+	free(replay.toPosition);
+	free(replay.applied);
+	stopTracing();
+}
+
+/* The shard owning an account name */
+static inline int shardOf(unsigned int name)
+{
+	return (int) (name % (unsigned int) shards.numShards);
+}
+
+/* The ring from a shard, or the router when source is the number of shards, to a shard */
+ShardRing *shardRing(int source, int destination)
+{
+	return &shards.rings[source * shards.numShards + destination];
+}
+
+/* Put a message on a ring, returns FALSE when the ring is full */
+int pushShardMessage(ShardRing *ring, const ShardMessage *message)
+{
+	uint32_t tail;
+	
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	
+	if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == SHARD_RING_SIZE)
+		return FALSE;
+		
+	ring->messages[tail % SHARD_RING_SIZE] = *message;
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	
+	return TRUE;
+}
+
+/* Take a message off a ring, returns FALSE when the ring is empty */
+int popShardMessage(ShardRing *ring, ShardMessage *message)
+{
+	uint32_t head;
+	
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	
+	if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+		return FALSE;
+		
+	*message = ring->messages[head % SHARD_RING_SIZE];
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	
+	return TRUE;
+}
+
+/* Send a message to another shard. A shard never waits on a full ring, since the shard on
+the other end may be waiting on one of ours, the message is kept in the outbox instead.
+It counts as in flight from now until it has been handled */
+void sendShardMessage(int destination, ShardMessage *message)
+{
+	ShardOutbox *outbox;
+	
+	message->shard = (unsigned short) shards.self;
+	__atomic_fetch_add(&shards.shared->inFlight, 1, __ATOMIC_SEQ_CST);
+	outbox = &shards.outboxes[destination];
+	
+	if(outbox->count == 0 && pushShardMessage(shardRing(shards.self, destination), message))
+		return;
+		
+	if(outbox->first + outbox->count == outbox->capacity)
+	{
+		/* Move what is left to the front before growing */
+		if(outbox->first > 0)
+			memmove(outbox->messages, outbox->messages + outbox->first, outbox->count * sizeof(ShardMessage));
+			
+		outbox->first = 0;
+		
+		if(outbox->count == outbox->capacity)
+		{
+			outbox->capacity = outbox->capacity == 0 ? 256 : outbox->capacity * 2;
+			outbox->messages = (ShardMessage *) realloc(outbox->messages, outbox->capacity * sizeof(ShardMessage));
+		}
+	}
+	
+	outbox->messages[outbox->first + outbox->count++] = *message;
+}
+
+/* Move what the outboxes hold onto the rings, returns TRUE when every outbox is empty */
+int flushShardOutboxes()
+{
+	ShardOutbox *outbox;
+	int empty;
+	int i;
+	
+	empty = TRUE;
+	
+	for(i = 0; i < shards.numShards; i++)
+	{
+		outbox = &shards.outboxes[i];
+		
+		while(outbox->count > 0 && pushShardMessage(shardRing(shards.self, i), &outbox->messages[outbox->first]))
+		{
+			outbox->first++;
+			outbox->count--;
+		}
+		
+		if(outbox->count == 0)
+			outbox->first = 0;
+		else
+			empty = FALSE;
+	}
+	
+	return empty;
+}
+
+/* Run a job whose accounts all belong to this shard, and book the money it moved from what
+the account operations charged. The balances are only compared with the ledgers once
+every shard is done */
+void runShardJob(Transaction *transaction, Job *job)
+{
+	memset(&currentJobCharges, 0, sizeof(JobCharges));
+	executeJob(transaction, job);
+	
+	shards.ledger.numJobs++;
+	shards.ledger.deposited += currentJobCharges.deposited;
+	shards.ledger.withdrawn += currentJobCharges.withdrawn;
+	shards.ledger.paidOut += currentJobCharges.paidOut;
+	shards.ledger.fees += currentJobCharges.fees;
+	shards.ledger.forfeited += currentJobCharges.forfeited;
+}
+
+/* Send the job after a finished one to the shard of its first account. The jobs of a
+transaction run one after another, as on its thread, and the shard that finishes one
+hands on the next */
+void routeNextJob(unsigned int transaction, unsigned int position)
+{
+	ShardMessage message;
+	
+	if(position + 1 >= (unsigned int) transactionsList.transactions[transaction].numJobs)
+		return;
+		
+	message.kind = SHARD_JOB;
+	message.credit = FALSE;
+	message.transaction = transaction;
+	message.position = position + 1;
+	message.reservation = 0;
+	message.job = *jobAt(&shards.cursor, &transactionsList.transactions[transaction], position + 1);
+	sendShardMessage(shardOf(message.job.fromAccount), &message);
+}
+
+/* Take a free reservation number */
+unsigned int takeReservation()
+{
+	if(shards.numFreeReservations > 0)
+		return shards.freeReservations[--shards.numFreeReservations];
+		
+	if(shards.numReservations == shards.reservationsCapacity)
+	{
+		shards.reservationsCapacity = shards.reservationsCapacity == 0 ? 256 : shards.reservationsCapacity * 2;
+		shards.reservations = (ShardReservation *) realloc(shards.reservations, shards.reservationsCapacity * sizeof(ShardReservation));
+		shards.freeReservations = (unsigned int *) realloc(shards.freeReservations, shards.reservationsCapacity * sizeof(unsigned int));
+	}
+	
+	return shards.numReservations++;
+}
+
+/* First phase of a transfer to an account of another shard, on the sender's shard. The
+sender's fees and the overdraft rules are those of transferFundsFromAndToAccount, when
+they let the transfer go ahead the amount and the fees are reserved by taking them off
+the balance, and the receiver's shard is asked to prepare its side. As there, a sender
+going into overdraft pays the amount but the receiver isn't credited with it. Returns
+FALSE when the transfer ended here */
+int reserveTransfer(ShardMessage *jobMessage)
+{
+	Transaction *transaction;
+	Job *job;
+	AccountBlock *block;
+	ShardReservation *reservation;
+	ShardMessage message;
+	FeeSchedule *schedule;
+	unsigned int index;
+	int slot;
+	int fees;
+	int num500s;
+	int reserved;
+	int credit;
+	
+	transaction = &transactionsList.transactions[jobMessage->transaction];
+	job = &jobMessage->job;
+	
+	LOG("%s transfers $%d from account %s to account %s\n", transaction->id, 
+		job->amount, accountName(job->fromAccount), accountName(job->toAccount));
+	shards.ledger.numJobs++;
+	index = findOpenAccount(job->fromAccount);
+	
+	if(index == ACCOUNT_NONE)
+	{
+		LOG("    Job rejected, account is not open\n\n");
+		directory.numRejected++;
+		return FALSE;
+	}
+	
+	slot = index % ACCOUNTS_PER_BLOCK;
+	block = &accountsList.blocks[index / ACCOUNTS_PER_BLOCK];
+	schedule = accountFees(block, index);
+	reserved = FALSE;
+	credit = FALSE;
+	
+	lockAccount(index);
+	LOG("    Account (Sender) %s has starting balance of $%" PRId64 ", the receiver is on shard %d\n",
+		accountId(index), block->balances[slot], shardOf(job->toAccount));
+	
+	fees = schedule->transferFee;
+	LOG("    Account (Sender) %s has transfer fee of $%d\n", accountId(index), schedule->transferFee);
+	
+	if(block->numTransactions[slot] > schedule->transactionFeeThreshold)
+	{
+		LOG("    Account (Sender) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(index), schedule->transactionFee, block->numTransactions[slot], schedule->transactionFeeThreshold);
+		fees += schedule->transactionFee;
+	}
+	
+	if(block->balances[slot] >= job->amount + fees)
+	{
+		reserved = TRUE;
+		credit = TRUE;
+	}
+	else if(block->flags[slot] & ACCOUNT_OVERDRAFT_PROTECTED)
+	{
+		num500s = (job->amount / 500) + 1;
+		fees += num500s * schedule->overdraftFee;
+		
+		LOG("    Account %s (Sender) has overdraft fee of $%d ($%d fee for every excess of $500)\n", 
+			accountId(index), num500s * schedule->overdraftFee, schedule->overdraftFee);
+		
+		if(block->balances[slot] - fees - job->amount >= -5000)
+			reserved = TRUE;
+		else
+		{
+			LOG("    Transfer rejected, amount (with fees) cannot continue \n");
+			LOG("        because overdraft limit cannot go above $5000 for sender\n");
+		}
+	}
+	else
+	{
+		LOG("    Transfer rejected, amount (with fees) cannot continue \n");
+		LOG("        because of insufficient balance of sender\n");
+	}
+	
+	if(reserved)
+	{
+		block->balances[slot] -= job->amount;
+		block->balances[slot] -= fees;
+		block->numTransactions[slot]++;
+		shards.ledger.numCrossTransfers++;
+		
+		message.kind = SHARD_PREPARE;
+		message.credit = (unsigned char) credit;
+		message.transaction = jobMessage->transaction;
+		message.position = jobMessage->position;
+		message.reservation = takeReservation();
+		message.job = *job;
+		reservation = &shards.reservations[message.reservation];
+		reservation->name = job->fromAccount;
+		reservation->index = index;
+		reservation->amount = credit ? job->amount : 0;
+		reservation->forfeited = credit ? 0 : job->amount;
+		reservation->fees = fees;
+		shards.ledger.sent += reservation->amount;
+		shards.ledger.forfeited += reservation->forfeited;
+		shards.ledger.fees += fees;
+		sendShardMessage(shardOf(job->toAccount), &message);
+	}
+	
+	LOG("    Account %s has ending balance of $%" PRId64 "\n\n", accountId(index), block->balances[slot]);
+	unlockAccount(index);
+	
+	return reserved;
+}
+
+/* Second phase of a cross shard transfer, on the receiver's shard. The receiver pays its
+own transfer and transaction fees out of the amount, the sender's shard is told to commit,
+or to abort when the receiver isn't open. A transfer that doesn't credit the receiver
+only needs it to be open */
+void prepareTransfer(const ShardMessage *prepare)
+{
+	AccountBlock *block;
+	ShardMessage message;
+	FeeSchedule *schedule;
+	unsigned int index;
+	int slot;
+	int fees;
+	
+	message.kind = SHARD_ABORT;
+	message.credit = prepare->credit;
+	message.transaction = prepare->transaction;
+	message.position = prepare->position;
+	message.reservation = prepare->reservation;
+	message.job = prepare->job;
+	index = findOpenAccount(prepare->job.toAccount);
+	
+	if(index == ACCOUNT_NONE)
+	{
+		LOG("Transfer of $%d from account %s rejected, account %s is not open\n\n",
+			prepare->job.amount, accountName(prepare->job.fromAccount), accountName(prepare->job.toAccount));
+		directory.numRejected++;
+		sendShardMessage(prepare->shard, &message);
+		return;
+	}
+	
+	message.kind = SHARD_COMMIT;
+	
+	if(!prepare->credit)
+	{
+		sendShardMessage(prepare->shard, &message);
+		return;
+	}
+	
+	slot = index % ACCOUNTS_PER_BLOCK;
+	block = &accountsList.blocks[index / ACCOUNTS_PER_BLOCK];
+	schedule = accountFees(block, index);
+	
+	lockAccount(index);
+	LOG("Receiving $%d from account %s\n", prepare->job.amount, accountName(prepare->job.fromAccount));
+	LOG("    Account (Receiver) %s has starting balance of $%" PRId64 "\n", accountId(index), block->balances[slot]);
+	
+	fees = schedule->transferFee;
+	LOG("    Account (Receiver) %s has transfer fee of $%d\n", accountId(index), schedule->transferFee);
+	
+	if(block->numTransactions[slot] > schedule->transactionFeeThreshold)
+	{
+		LOG("    Account (Receiver) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
+			accountId(index), schedule->transactionFee, block->numTransactions[slot], schedule->transactionFeeThreshold);
+		fees += schedule->transactionFee;
+	}
+	
+	block->balances[slot] += prepare->job.amount;
+	block->balances[slot] -= fees;
+	block->numTransactions[slot]++;
+	shards.ledger.received += prepare->job.amount;
+	shards.ledger.fees += fees;
+	
+	LOG("    Account %s has ending balance of $%" PRId64 "\n\n", accountId(index), block->balances[slot]);
+	unlockAccount(index);
+	sendShardMessage(prepare->shard, &message);
+}
+
+/* Last phase of a cross shard transfer, back on the sender's shard. A commit only lets go
+of the reservation, an abort gives the funds back. If the sender was closed in between,
+the reserved funds are paid out the way the close paid out the rest of the balance. The
+transfer is done either way and its transaction goes on */
+void finishTransfer(const ShardMessage *message)
+{
+	ShardReservation *reservation;
+	AccountBlock *block;
+	int slot;
+	
+	reservation = &shards.reservations[message->reservation];
+	
+	if(message->kind == SHARD_ABORT)
+	{
+		shards.ledger.sent -= reservation->amount;
+		shards.ledger.forfeited -= reservation->forfeited;
+		shards.ledger.fees -= reservation->fees;
+		shards.ledger.numAborted++;
+		
+		if(directory.slots[reservation->name] == reservation->index)
+		{
+			slot = reservation->index % ACCOUNTS_PER_BLOCK;
+			block = &accountsList.blocks[reservation->index / ACCOUNTS_PER_BLOCK];
+			
+			lockAccount(reservation->index);
+			block->balances[slot] += reservation->amount + reservation->forfeited + reservation->fees;
+			block->numTransactions[slot]--;
+			LOG("Transfer from account %s aborted, $%d given back\n\n", accountId(reservation->index),
+				reservation->amount + reservation->forfeited + reservation->fees);
+			unlockAccount(reservation->index);
+		}
+		else
+			shards.ledger.paidOut += reservation->amount + reservation->forfeited + reservation->fees;
+	}
+	
+	shards.freeReservations[shards.numFreeReservations++] = message->reservation;
+	routeNextJob(message->transaction, message->position);
+}
+
+/* A method for each shard process. It takes messages from the router and the other shards
+until the router has stopped it and no message between shards is left anywhere, then
+leaves the state of its accounts and its ledger in the shared mapping */
+void runShard(int self)
+{
+	ShardMessage message;
+	AccountBlock *block;
+	ShardResult *result;
+	unsigned int index;
+	unsigned int name;
+	int stopped;
+	int worked;
+	int source;
+	
+	shards.self = self;
+	memset(&shards.ledger, 0, sizeof(ShardLedger));
+	memset(shards.outboxes, 0, sizeof(shards.outboxes));
+	shards.reservations = NULL;
+	shards.freeReservations = NULL;
+	shards.numReservations = 0;
+	shards.numFreeReservations = 0;
+	shards.reservationsCapacity = 0;
+	shards.cursor.transaction = NULL;
+	stopped = FALSE;
+	
+	while(TRUE)
+	{
+		worked = !flushShardOutboxes();
+		
+		for(source = 0; source <= shards.numShards; source++)
+		{
+			while(popShardMessage(shardRing(source, self), &message))
+			{
+				worked = TRUE;
+				
+				if(message.kind == SHARD_JOB && message.job.type == 't' && shardOf(message.job.toAccount) != self)
+				{
+					if(!reserveTransfer(&message))
+						routeNextJob(message.transaction, message.position);
+				}
+				else if(message.kind == SHARD_JOB)
+				{
+					runShardJob(&transactionsList.transactions[message.transaction], &message.job);
+					routeNextJob(message.transaction, message.position);
+				}
+				else if(message.kind == SHARD_PREPARE)
+					prepareTransfer(&message);
+				else if(message.kind == SHARD_COMMIT || message.kind == SHARD_ABORT)
+					finishTransfer(&message);
+				else if(message.kind == SHARD_BARRIER)
+					__atomic_fetch_add(&shards.shared->numAtBarrier, 1, __ATOMIC_SEQ_CST);
+				else if(message.kind == SHARD_STOP)
+				{
+					stopped = TRUE;
+					__atomic_fetch_add(&shards.shared->numStopped, 1, __ATOMIC_SEQ_CST);
+				}
+				
+				/* Anything the message sent on is in flight already */
+				if(source < shards.numShards)
+					__atomic_fetch_sub(&shards.shared->inFlight, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		
+		if(worked)
+			continue;
+			
+		/* Once every shard has every job from the router, new messages only come from
+		messages still in flight */
+		if(stopped && __atomic_load_n(&shards.shared->numStopped, __ATOMIC_SEQ_CST) == (uint32_t) shards.numShards
+			&& __atomic_load_n(&shards.shared->inFlight, __ATOMIC_SEQ_CST) == 0)
+			break;
+			
+		sched_yield();
+	}
+	
+	for(name = (unsigned int) self; name < directory.numNames; name += shards.numShards)
+	{
+		result = &shards.results[name];
+		index = directory.slots[name];
+		result->open = index != ACCOUNT_NONE;
+		
+		if(index == ACCOUNT_NONE)
+			continue;
+			
+		block = &accountsList.blocks[index / ACCOUNTS_PER_BLOCK];
+		result->balance = block->balances[index % ACCOUNTS_PER_BLOCK];
+		result->numTransactions = block->numTransactions[index % ACCOUNTS_PER_BLOCK];
+		result->feeSchedule = block->feeSchedules[index % ACCOUNTS_PER_BLOCK];
+		result->flags = block->flags[index % ACCOUNTS_PER_BLOCK];
+	}
+	
+	shards.ledger.numOpened = directory.numOpened;
+	shards.ledger.numClosed = directory.numClosed;
+	shards.ledger.numReused = directory.numReused;
+	shards.ledger.numRejected = directory.numRejected;
+	shards.ledger.done = TRUE;
+	shards.shared->ledgers[self] = shards.ledger;
+	
+	for(source = 0; source < shards.numShards; source++)
+		free(shards.outboxes[source].messages);
+		
+	free(shards.reservations);
+	free(shards.freeReservations);
+}
+
+/* Send a message from the router, waiting while the shard's ring is full */
+void routeShardMessage(int destination, const ShardMessage *message)
+{
+	while(!pushShardMessage(shardRing(shards.numShards, destination), message))
+		sched_yield();
+}
+
+/* Send the first job of every depositor or of every client to the shard of its first
+account, the shards hand on the rest */
+void routeJobs(char prefix)
+{
+	Transaction *transaction;
+	ShardMessage message;
+	JobCursor cursor;
+	int i;
+	
+	cursor.transaction = NULL;
+	message.kind = SHARD_JOB;
+	message.credit = FALSE;
+	message.shard = (unsigned short) shards.numShards;
+	message.position = 0;
+	message.reservation = 0;
+	
+	for(i = 0; i < transactionsList.numTransactions; i++)
+	{
+		transaction = &transactionsList.transactions[i];
+		
+		if(transaction->id[0] != prefix || transaction->numJobs == 0)
+			continue;
+			
+		message.transaction = i;
+		message.job = *jobAt(&cursor, transaction, 0);
+		routeShardMessage(shardOf(message.job.fromAccount), &message);
+	}
+}
+
+/* Sum of the balances of the open accounts */
+int64_t totalBalance()
+{
+	unsigned int i;
+	unsigned int index;
+	int64_t total;
+	
+	total = 0;
+	
+	for(i = 0; i < directory.numNames; i++)
+	{
+		index = directory.slots[i];
+		
+		if(index != ACCOUNT_NONE)
+			total += accountsList.blocks[index / ACCOUNTS_PER_BLOCK].balances[index % ACCOUNTS_PER_BLOCK];
+	}
+	
+	return total;
+}
+
+/* Put the accounts the shards finished with back into this process. Closes go first so
+their slots can be taken by the opens */
+void mergeShardResults()
+{
+	AccountBlock *block;
+	ShardResult *result;
+	unsigned int index;
+	unsigned int name;
+	int slot;
+	
+	for(name = 0; name < directory.numNames; name++)
+	{
+		index = directory.slots[name];
+		
+		if(!shards.results[name].open && index != ACCOUNT_NONE)
+		{
+			accountsList.blocks[index / ACCOUNTS_PER_BLOCK].balances[index % ACCOUNTS_PER_BLOCK] = 0;
+			accountsList.blocks[index / ACCOUNTS_PER_BLOCK].flags[index % ACCOUNTS_PER_BLOCK] |= ACCOUNT_CLOSED;
+			directory.slots[name] = ACCOUNT_NONE;
+			returnAccountSlot(index, FALSE);
+		}
+	}
+	
+	for(name = 0; name < directory.numNames; name++)
+	{
+		result = &shards.results[name];
+		
+		if(!result->open)
+			continue;
+			
+		index = directory.slots[name];
+		
+		if(index == ACCOUNT_NONE)
+		{
+			index = takeAccountSlot();
+			accountsList.ids[index] = directory.names[name];
+			directory.slots[name] = index;
+		}
+		
+		slot = index % ACCOUNTS_PER_BLOCK;
+		block = &accountsList.blocks[index / ACCOUNTS_PER_BLOCK];
+		block->balances[slot] = result->balance;
+		block->numTransactions[slot] = result->numTransactions;
+		block->feeSchedules[slot] = result->feeSchedule;
+		block->flags[slot] = result->flags;
+	}
+}
+
+/* Run the jobs on shard processes and merge what they did back into this process. The
+depositors go first and the clients only once every shard is done with them, as with
+the threads. Returns FALSE when a shard failed or money was made or lost on the way */
+int runShards(int numShards)
+{
+	ShardLedger total;
+	ShardLedger *ledger;
+	pid_t pids[MAX_SHARDS];
+	ShardMessage message;
+	size_t ringsOffset;
+	size_t resultsOffset;
+	int64_t before;
+	int64_t after;
+	int status;
+	int failed;
+	int i;
+	
+	/* One mapping for the counters, a ring for every pair and the router, and the results */
+	shards.numShards = numShards;
+	ringsOffset = (sizeof(ShardShared) + 63) & ~(size_t) 63;
+	resultsOffset = ringsOffset + (size_t) (numShards + 1) * numShards * sizeof(ShardRing);
+	shards.size = resultsOffset + (directory.numNames + 1) * sizeof(ShardResult);
+	shards.shared = (ShardShared *) mmap(NULL, shards.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	
+	if(shards.shared == MAP_FAILED)
+	{
+		perror("mmap");
+		return FALSE;
+	}
+	
+	shards.rings = (ShardRing *) ((char *) shards.shared + ringsOffset);
+	shards.results = (ShardResult *) ((char *) shards.shared + resultsOffset);
+	before = totalBalance();
+	
+	/* Whatever is buffered would otherwise be written once by every shard too */
+	fflush(stdout);
+	fflush(stderr);
+	
+	for(i = 0; i < numShards; i++)
+	{
+		pids[i] = fork();
+		
+		if(pids[i] == 0)
+		{
+			runShard(i);
+			fflush(stdout);
+			_exit(0);
+		}
+		
+		if(pids[i] < 0)
+		{
+			perror("fork");
+			numShards = i;
+			break;
+		}
+	}
+	
+	message.kind = SHARD_BARRIER;
+	message.credit = FALSE;
+	message.reservation = 0;
+	
+	if(numShards == shards.numShards)
+	{
+		routeJobs('d');
+		
+		for(i = 0; i < numShards; i++)
+			routeShardMessage(i, &message);
+			
+		while(__atomic_load_n(&shards.shared->numAtBarrier, __ATOMIC_SEQ_CST) < (uint32_t) numShards
+			|| __atomic_load_n(&shards.shared->inFlight, __ATOMIC_SEQ_CST) != 0)
+			sched_yield();
+			
+		routeJobs('c');
+	}
+	
+	/* A shard that never got its jobs is still stopped, it just has nothing to do */
+	message.kind = SHARD_STOP;
+	failed = numShards != shards.numShards;
+	
+	for(i = 0; i < numShards; i++)
+		routeShardMessage(i, &message);
+		
+	for(i = 0; i < numShards; i++)
+	{
+		if(waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !shards.shared->ledgers[i].done)
+			failed = TRUE;
+	}
+	
+	if(failed)
+	{
+		fprintf(stderr, "A shard process failed\n");
+		munmap(shards.shared, shards.size);
+		return FALSE;
+	}
+	
+	mergeShardResults();
+	after = totalBalance();
+	
+	/* The money in the accounts changed by what came in and went out, and every amount
+	that left a shard arrived at another */
+	memset(&total, 0, sizeof(ShardLedger));
+	
+	for(i = 0; i < numShards; i++)
+	{
+		ledger = &shards.shared->ledgers[i];
+		total.deposited += ledger->deposited;
+		total.withdrawn += ledger->withdrawn;
+		total.paidOut += ledger->paidOut;
+		total.fees += ledger->fees;
+		total.forfeited += ledger->forfeited;
+		total.sent += ledger->sent;
+		total.received += ledger->received;
+		total.numJobs += ledger->numJobs;
+		total.numCrossTransfers += ledger->numCrossTransfers;
+		total.numAborted += ledger->numAborted;
+		total.numOpened += ledger->numOpened;
+		total.numClosed += ledger->numClosed;
+		total.numReused += ledger->numReused;
+		total.numRejected += ledger->numRejected;
+	}
+	
+	directory.numOpened = total.numOpened;
+	directory.numClosed = total.numClosed;
+	directory.numReused = total.numReused;
+	directory.numRejected = total.numRejected;
+	shards.ledger = total;
+	munmap(shards.shared, shards.size);
+	shards.shared = NULL;
+	
+	if(total.sent != total.received || after - before != total.deposited - total.withdrawn - total.paidOut - total.fees - total.forfeited)
+	{
+		fprintf(stderr, "Money is not conserved: balances went from %" PRId64 " to %" PRId64 " with %" PRId64 " deposited, %" PRId64
+			" withdrawn, %" PRId64 " paid out, %" PRId64 " in fees, %" PRId64 " forfeited, %" PRId64 " sent and %" PRId64
+			" received between shards\n",
+			before, after, total.deposited, total.withdrawn, total.paidOut, total.fees, total.forfeited, total.sent, total.received);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/* Print what the shards did */
+void printShardStats(FILE *outFile)
+{
+	fprintf(outFile, "Shards:  %d processes, %u jobs, %u cross shard transfers (%u aborted), $%" PRId64 " moved between shards, "
+		"$%" PRId64 " in fees, money conserved\n",
+		shards.numShards, shards.ledger.numJobs, shards.ledger.numCrossTransfers, shards.ledger.numAborted,
+		shards.ledger.received, shards.ledger.fees);
+}
+
+/* Sum of one counter over the records of every thread */
+uint64_t sumMetric(int metric)
+{
+	MetricsRecord *record;
+	uint64_t sum;
+	
+	sum = 0;
+	
+	for(record = __atomic_load_n(&metrics.records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+		sum += __atomic_load_n(&record->counts[metric], __ATOMIC_RELAXED);
+		
+	return sum;
+}
+
+/* Print one counter or gauge in the Prometheus text format */
+void printMetric(FILE *outFile, const char *name, const char *type, const char *help, double value)
+{
+	fprintf(outFile, "# HELP asn3_%s %s\n# TYPE asn3_%s %s\nasn3_%s %.15g\n", name, help, name, type, name, value);
+}
+
+/* Print every metric in the Prometheus text format. Utilization is the share of the workers
+(-w) or of the processors that was busy in transactions since the last export */
+void writeMetrics(FILE *outFile)
+{
+	MetricsRecord *record;
+	uint64_t busy;
+	double time;
+	double utilization;
+	int numThreads;
+	int i;
+	
+	busy = sumMetric(METRIC_BUSY_NS);
+	time = now();
+	utilization = (busy - metrics.lastBusy) / 1e9 / ((time - metrics.lastTime) * metrics.numWorkers);
+	metrics.lastBusy = busy;
+	metrics.lastTime = time;
+	numThreads = 0;
+	
+	for(record = __atomic_load_n(&metrics.records, __ATOMIC_ACQUIRE); record != NULL; record = record->next)
+		numThreads += __atomic_load_n(&record->inUse, __ATOMIC_RELAXED);
+	
+	printMetric(outFile, "jobs_applied_total", "counter", "Jobs applied to open accounts.", sumMetric(METRIC_JOBS_APPLIED));
+	printMetric(outFile, "jobs_rejected_total", "counter", "Jobs rejected because their account was not open, or already open.",
+		sumMetric(METRIC_JOBS_REJECTED));
+	printMetric(outFile, "withdrawals_rejected_total", "counter", "Withdrawals rejected for the balance or the overdraft limit.",
+		sumMetric(METRIC_WITHDRAWALS_REJECTED));
+	printMetric(outFile, "transfers_rejected_total", "counter", "Transfers rejected for the sender's balance or overdraft limit.",
+		sumMetric(METRIC_TRANSFERS_REJECTED));
+	printMetric(outFile, "fees_collected_dollars_total", "counter", "Fees charged by deposits, withdrawals and transfers.",
+		sumMetric(METRIC_FEES));
+	printMetric(outFile, "transactions_finished_total", "counter", "Depositor and client transactions run to the end.",
+		sumMetric(METRIC_TRANSACTIONS));
+	printMetric(outFile, "transactions_pending", "gauge", "Transactions not finished yet.",
+		transactionsList.numTransactions - (double) sumMetric(METRIC_TRANSACTIONS));
+	printMetric(outFile, "busy_seconds_total", "counter", "Wall time threads spent running transactions.", busy / 1e9);
+	printMetric(outFile, "worker_utilization", "gauge", "Busy share of the workers since the last export.", utilization);
+	printMetric(outFile, "threads", "gauge", "Threads that have counted something and are still running.", numThreads);
+	
+	/* The queues change under the scheduler lock, reading them takes it once per export */
+	if(__atomic_load_n(&metrics.watchQueues, __ATOMIC_ACQUIRE))
+	{
+		fprintf(outFile, "# HELP asn3_queue_depth Work items waiting in each scheduler class.\n# TYPE asn3_queue_depth gauge\n");
+		pthread_mutex_lock(&scheduler.lock);
+		
+		for(i = 0; i < NUM_CLASSES; i++)
+			fprintf(outFile, "asn3_queue_depth{class=\"%s\"} %d\n", scheduler.queues[i].name, scheduler.queues[i].length);
+			
+		pthread_mutex_unlock(&scheduler.lock);
+	}
+	
+	metrics.numExports++;
+}
+
+/* Write the metrics to a file next to the target and rename it over the target, so a reader
+only ever sees a complete export */
+int exportMetricsFile()
+{
+	char tempPath[4096];
+	FILE *outFile;
+	
+	snprintf(tempPath, sizeof(tempPath), "%s.tmp", metrics.path);
+	outFile = fopen(tempPath, "w");
+	
+	if(outFile == NULL)
+		return FALSE;
+		
+	writeMetrics(outFile);
+	
+	if(fclose(outFile) != 0 || rename(tempPath, metrics.path) != 0)
+		return FALSE;
+		
+	return TRUE;
+}
+
+/* Answer one connection on the metrics socket. A client that sends an HTTP request gets an
+HTTP response, anything else just gets the text */
+void serveMetricsScrape()
+{
+	struct pollfd pollFd;
+	char request[512];
+	FILE *outFile;
+	ssize_t length;
+	int fd;
+	
+	fd = accept(metrics.listenFd, NULL, NULL);
+	
+	if(fd < 0)
+		return;
+		
+	pollFd.fd = fd;
+	pollFd.events = POLLIN;
+	length = poll(&pollFd, 1, 2 * METRICS_TICK_MS) > 0 ? recv(fd, request, sizeof(request) - 1, 0) : 0;
+	outFile = fdopen(fd, "w");
+	
+	if(outFile == NULL)
+	{
+		close(fd);
+		return;
+	}
+	
+	if(length >= 4 && strncmp(request, "GET ", 4) == 0)
+		fprintf(outFile, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		
+	writeMetrics(outFile);
+	fclose(outFile);
+}
+
+/* The exporter thread, writes the file every period or answers the socket until the run ends */
+void *exportThread(void *args)
+{
+	struct pollfd pollFd;
+	double nextExport;
+	
+	(void) args;
+	
+	pollFd.fd = metrics.listenFd;
+	pollFd.events = POLLIN;
+	nextExport = now() + metrics.periodMs / 1e3;
+	
+	while(!__atomic_load_n(&metrics.stopExporting, __ATOMIC_RELAXED))
+	{
+		if(poll(&pollFd, metrics.listenFd >= 0 ? 1 : 0, METRICS_TICK_MS) > 0)
+			serveMetricsScrape();
+			
+		if(metrics.listenFd < 0 && now() >= nextExport)
+		{
+			if(!exportMetricsFile())
+				perror(metrics.path);
+				
+			nextExport += metrics.periodMs / 1e3;
+		}
+	}
+	
+	return (void *) NULL;
+}
+
+/* Start counting and the exporter thread. A path starting with unix: is a socket to listen
+on, anything else a file to write. Returns FALSE when the socket can't be set up */
+int startExporting(const char *path, unsigned int periodMs, int numWorkers)
+{
+	struct sockaddr_un address;
+	
+	metrics.records = NULL;
+	metrics.path = path;
+	metrics.listenFd = -1;
+	metrics.periodMs = periodMs > 0 ? periodMs : 1000;
+	metrics.numWorkers = numWorkers > 0 ? numWorkers : 1;
+	metrics.stopExporting = FALSE;
+	metrics.watchQueues = FALSE;
+	metrics.numExports = 0;
+	metrics.lastTime = now();
+	metrics.lastBusy = 0;
+	
+	if(strncmp(path, "unix:", 5) == 0)
+	{
+		metrics.path = path + 5;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		
+		if(strlen(metrics.path) >= sizeof(address.sun_path))
+			return FALSE;
+			
+		strcpy(address.sun_path, metrics.path);
+		metrics.listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		
+		if(metrics.listenFd < 0 || bind(metrics.listenFd, (struct sockaddr *) &address, sizeof(address)) != 0
+			|| listen(metrics.listenFd, 16) != 0)
+		{
+			if(metrics.listenFd >= 0)
+				close(metrics.listenFd);
+				
+			return FALSE;
+		}
+	}
+	
+	pthread_key_create(&metrics.key, &releaseMetricsRecord);
+	metrics.enabled = TRUE;
+	pthread_create(&metrics.exporter, NULL, &exportThread, NULL);
+	
+	return TRUE;
+}
+
+/* Stop the exporter once the jobs are done. The file gets a last export with the final
+counts and the queue depths, the socket goes away */
+void stopExporting()
+{
+	__atomic_store_n(&metrics.stopExporting, TRUE, __ATOMIC_RELAXED);
+	pthread_join(metrics.exporter, NULL);
+	
+	if(metrics.listenFd >= 0)
+	{
+		close(metrics.listenFd);
+		unlink(metrics.path);
+	}
+	else if(!exportMetricsFile())
+		perror(metrics.path);
+		
+	/* Threads still alive must not hand their records back once they are gone */
+	pthread_key_delete(metrics.key);
+	metrics.enabled = FALSE;
+	metrics.watchQueues = FALSE;
+}
+
+/* Open one counter for this process, inherited by every thread created after it */
+int openPerfCounter(uint32_t type, uint64_t config)
+{
+	struct perf_event_attr attr;
+	
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.inherit = 1;
+	attr.exclude_hv = 1;
+	
+	/* Context switches are counted by the kernel, only the hardware counters skip it */
+	attr.exclude_kernel = type != PERF_TYPE_SOFTWARE;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Open the counters, any of them may be missing (no PMU in a VM, perf_event_paranoid, old kernel) */
+void startPerfCounters()
+{
+	int i;
+	
+	perfCounters.fds[PERF_CYCLES] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	perfCounters.fds[PERF_INSTRUCTIONS] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	perfCounters.fds[PERF_L1_MISSES] = openPerfCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D 
+		| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	perfCounters.fds[PERF_LLC_MISSES] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	perfCounters.fds[PERF_CONTEXT_SWITCHES] = openPerfCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+	perfCounters.numOpen = 0;
+	
+	for(i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if(perfCounters.fds[i] >= 0)
+			perfCounters.numOpen++;
+	}
+}
+
+/* Read every open counter, the sum covers this thread and the threads it has created */
+void readPerfCounters(PerfSample *sample)
+{
+	uint64_t data[3];
+	int i;
+	
+	for(i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		sample->values[i] = 0;
+		
+		if(perfCounters.fds[i] < 0 || read(perfCounters.fds[i], data, sizeof(data)) != sizeof(data))
+			continue;
+			
+		/* Scale up when the kernel had to multiplex the counter with others */
+		if(data[2] > 0 && data[2] < data[1])
+			sample->values[i] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+		else
+			sample->values[i] = data[0];
+	}
+}
+
+/* Mark the start of a phase */
+void beginPerfPhase(PerfPhase *phase, const char *name)
+{
+	phase->name = name;
+	phase->used = perfCounters.numOpen > 0;
+	
+	if(phase->used)
+		readPerfCounters(&phase->start);
+}
+
+/* Mark the end of a phase and keep what it counted */
+void endPerfPhase(PerfPhase *phase)
+{
+	PerfSample sample;
+	int i;
+	
+	if(!phase->used)
+		return;
+		
+	readPerfCounters(&sample);
+	
+	for(i = 0; i < NUM_PERF_COUNTERS; i++)
+		phase->counts.values[i] = sample.values[i] - phase->start.values[i];
+}
+
+/* Print a counter, or n/a when it couldn't be opened */
+void printPerfValue(FILE *outFile, int counter, double value, const char *format)
+{
+	fprintf(outFile, " ");
+	
+	if(perfCounters.fds[counter] >= 0)
+		fprintf(outFile, format, value);
+	else
+		fprintf(outFile, "%10s", "n/a");
+}
+
+/* Print IPC and misses per job of each phase, the figures to compare when the layout changes */
+void printPerfPhases(FILE *outFile, const PerfPhase *phases, int numPhases, unsigned int numJobs)
+{
+	const uint64_t *values;
+	double jobs;
+	int i;
+	
+	if(perfCounters.numOpen == 0)
+	{
+		fprintf(outFile, "Counters: not available here, see /proc/sys/kernel/perf_event_paranoid\n");
+		return;
+	}
+	
+	jobs = numJobs > 0 ? numJobs : 1;
+	fprintf(outFile, "Counters: %10s %10s %10s %10s %10s %10s %10s\n", 
+		"Mcycles", "Minstr", "IPC", "L1miss/job", "LLCmiss/job", "cycles/job", "ctxsw");
+	
+	for(i = 0; i < numPhases; i++)
+	{
+		if(!phases[i].used)
+			continue;
+			
+		values = phases[i].counts.values;
+		fprintf(outFile, "%-9s", phases[i].name);
+		printPerfValue(outFile, PERF_CYCLES, values[PERF_CYCLES] / 1e6, "%10.2f");
+		printPerfValue(outFile, PERF_INSTRUCTIONS, values[PERF_INSTRUCTIONS] / 1e6, "%10.2f");
+		
+		if(perfCounters.fds[PERF_CYCLES] >= 0 && perfCounters.fds[PERF_INSTRUCTIONS] >= 0 && values[PERF_CYCLES] > 0)
+			fprintf(outFile, " %10.2f", (double) values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+		else
+			fprintf(outFile, " %10s", "n/a");
+			
+		printPerfValue(outFile, PERF_L1_MISSES, values[PERF_L1_MISSES] / jobs, "%10.2f");
+		printPerfValue(outFile, PERF_LLC_MISSES, values[PERF_LLC_MISSES] / jobs, "%10.2f");
+		printPerfValue(outFile, PERF_CYCLES, values[PERF_CYCLES] / jobs, "%10.0f");
+		printPerfValue(outFile, PERF_CONTEXT_SWITCHES, (double) values[PERF_CONTEXT_SWITCHES], "%10.0f");
+		fprintf(outFile, "\n");
+	}
+}
+
+/* Close the counters */
+void stopPerfCounters()
+{
+	int i;
+	
+	for(i = 0; i < NUM_PERF_COUNTERS; i++)
+	{
+		if(perfCounters.fds[i] >= 0)
+			close(perfCounters.fds[i]);
+			
+		perfCounters.fds[i] = -1;
+	}
+	
+	perfCounters.numOpen = 0;
+}
+
+/* Reserve the next transaction slot of a parser chunk */
+Transaction *nextTransaction(ParseChunk *chunk)
+{
+	if(chunk->numTransactions == chunk->transactionsCapacity)
+	{
+		chunk->transactionsCapacity = chunk->transactionsCapacity == 0 ? 64 : chunk->transactionsCapacity * 2;
+		chunk->transactions = (Transaction *) realloc(chunk->transactions, chunk->transactionsCapacity * sizeof(Transaction));
+	}
+	
+	return &chunk->transactions[chunk->numTransactions++];
+}
+
+/* Reserve the next job slot of a parser chunk */
+Job *nextJob(ParseChunk *chunk)
+{
+	if(chunk->numJobs == chunk->jobsCapacity)
+	{
+		chunk->jobsCapacity = chunk->jobsCapacity == 0 ? 256 : chunk->jobsCapacity * 2;
+		chunk->jobs = (Job *) realloc(chunk->jobs, chunk->jobsCapacity * sizeof(Job));
+	}
+	
+	return &chunk->jobs[chunk->numJobs++];
+}
+
+/* Name number of an account ID. IDs the account section doesn't have get a number within
+the chunk marked with LATE_NAME, numberLateNames gives them their final one */
+unsigned int findAccountName(const char *id, ParseChunk *chunk)
+{
+	unsigned int index;
+	
+	index = findAccount(id);
+	
+	if(index != ACCOUNT_NONE)
+		return index;
+		
+	return LATE_NAME | findOrAddName(&chunk->lateNames, id);
+}
+
+/* Fee schedule of the first account of a type in the account section, -1 if there is none */
+int findFeeScheduleByType(const char *type)
+{
+	unsigned int i;
+	
+	for(i = 0; i < feeSchedulesList.numSchedules; i++)
+	{
+		if(strcmp(stringPool.data + feeSchedulesList.schedules[i].type, type) == 0)
+			return (int) i;
+	}
+	
+	return -1;
+}
+
+/* Create a transaction inside a parser chunk, each trasaction will have a list of job */
+void addTransaction(char *line, ParseChunk *chunk)
+{
+	Transaction *transaction;
+	char *token;
+	char *savePtr;
+	Job *job;
+	int complete;
+	
+	transaction = nextTransaction(chunk);
+	transaction->id = NULL;
+	transaction->order = 0;
+	transaction->jobs = NULL;
+	transaction->encodedJobs = NULL;
+	transaction->numJobs = 0;
+	transaction->firstJob = chunk->numJobs;
+	transaction->progress = 0;
+	transaction->prefetched = 0;
+		
+	/* Extract the ID, strtok_r has already terminated it inside the input buffer */
+	token = strtok_r(line, DELIMITERS, &savePtr);
+	transaction->id = token;
+	
+	/* Extract the jobs */
+	token = strtok_r(NULL, DELIMITERS, &savePtr);
+	
+	while(token != NULL)
+	{
+		job = nextJob(chunk);
+		job->type = token[0];
+		job->fromAccount = ACCOUNT_NONE;
+		job->toAccount = ACCOUNT_NONE;
+		job->amount = 0;
+		complete = FALSE;
+		
+		if(job->type == 'd' || job->type == 'w')
+		{
+			/* Create a deposit or withdraw job */
+			token = strtok_r(NULL, DELIMITERS, &savePtr);
+			
+			if(token != NULL)
+			{
+				job->fromAccount = findAccountName(token, chunk);
+				token = strtok_r(NULL, DELIMITERS, &savePtr);
+			}
+			
+			if(token != NULL)
+				complete = sscanf(token, "%d", &job->amount) == 1;
+		}
+		else if(job->type == 't')
+		{
+			/* Create a fund transfer job */
+			token = strtok_r(NULL, DELIMITERS, &savePtr);
+			
+			if(token != NULL)
+			{
+				job->fromAccount = findAccountName(token, chunk);
+				token = strtok_r(NULL, DELIMITERS, &savePtr);
+			}
+			
+			if(token != NULL)
+			{
+				job->toAccount = findAccountName(token, chunk);
+				token = strtok_r(NULL, DELIMITERS, &savePtr);
+			}
+			
+			if(token != NULL)
+				complete = sscanf(token, "%d", &job->amount) == 1;
+		}
+		else if(job->type == 'o')
+		{
+			/* Create an account opening job, the type has to be one the account section uses */
+			token = strtok_r(NULL, DELIMITERS, &savePtr);
+			
+			if(token != NULL)
+			{
+				job->fromAccount = findAccountName(token, chunk);
+				token = strtok_r(NULL, DELIMITERS, &savePtr);
+			}
+			
+			if(token != NULL)
+			{
+				job->amount = findFeeScheduleByType(token);
+				complete = job->amount >= 0;
+			}
+		}
+		else if(job->type == 'x')
+		{
+			/* Create an account closing job */
+			token = strtok_r(NULL, DELIMITERS, &savePtr);
+			
+			if(token != NULL)
+			{
+				job->fromAccount = findAccountName(token, chunk);
+				complete = TRUE;
+			}
+		}
+		
+		/* Drop jobs that cannot be resolved instead of crashing on them later */
+		if(!complete || job->fromAccount == ACCOUNT_NONE || 
+			(job->type == 't' && (job->toAccount == ACCOUNT_NONE || job->toAccount == job->fromAccount)))
+		{
+			fprintf(stderr, "%s: malformed job or unknown account type, job skipped\n", transaction->id);
+			chunk->numJobs--;
+		}
+		else if(job->type == 'o')
+			chunk->numOpenJobs++;
+		else if(job->type == 'x')
+			chunk->numCloseJobs++;
+		
+		if(token != NULL)
+			token = strtok_r(NULL, DELIMITERS, &savePtr);
+	}
+	
+	transaction->numJobs = chunk->numJobs - transaction->firstJob;
+}
+
+/* A method for each parser thread, parses all complete lines of its chunk */
+void *parseChunkThread(void *args)
+{
+	ParseChunk *chunk;
+	char *line;
+	char *lineEnd;
+	
+	chunk = (ParseChunk *) args;
+	line = chunk->start;
+	
+	while(line < chunk->end)
+	{
+		/* Only the last chunk can end without a newline, and it ends on the buffer terminator */
+		lineEnd = (char *) memchr(line, '\n', chunk->end - line);
+		
+		if(lineEnd == NULL)
+			lineEnd = chunk->end;
+			
+		*lineEnd = '\0';
+		
+		if(line[0] == 'a')
+			fprintf(stderr, "Account line after the transaction section ignored: %s\n", line);
+		else if(line[strspn(line, DELIMITERS)] != '\0')
+			addTransaction(line, chunk);
+		
+		line = lineEnd + 1;
+	}
+	
+	return (void *) NULL;
+}
+
+/* Give the IDs the account section doesn't have their name numbers, after the loaded
+accounts and in the order they first appear in the input */
+void numberLateNames(ParseChunk *chunks, int numChunks)
+{
+	unsigned int *numbers;
+	unsigned int k;
+	Job *job;
+	int i;
+	int j;
+	
+	for(i = 0; i < numChunks; i++)
+	{
+		directory.numOpenJobs += chunks[i].numOpenJobs;
+		directory.numCloseJobs += chunks[i].numCloseJobs;
+		
+		if(chunks[i].lateNames.numNames == 0)
+			continue;
+			
+		numbers = (unsigned int *) malloc(chunks[i].lateNames.numNames * sizeof(unsigned int));
+		
+		for(k = 0; k < chunks[i].lateNames.numNames; k++)
+			numbers[k] = accountsList.numAccounts + findOrAddName(&directory.lateNames, chunks[i].lateNames.names[k]);
+			
+		for(j = 0; j < chunks[i].numJobs; j++)
+		{
+			job = &chunks[i].jobs[j];
+			
+			if(job->fromAccount & LATE_NAME)
+				job->fromAccount = numbers[job->fromAccount & ~LATE_NAME];
+				
+			if(job->type == 't' && (job->toAccount & LATE_NAME))
+				job->toAccount = numbers[job->toAccount & ~LATE_NAME];
+		}
+		
+		free(numbers);
+		deleteNameTable(&chunks[i].lateNames);
+	}
+}
+
+/* Split the transaction section at newlines, parse the chunks in parallel and merge
+them back into the transactions list in input file order */
+void parseTransactions(char *start, char *end, int numThreads)
+{
+	ParseChunk *chunks;
+	char *chunkStart;
+	char *chunkEnd;
+	int numChunks;
+	int i;
+	int j;
+	int n;
+	
+	numChunks = numThreads;
+	
+	if((end - start) / MIN_CHUNK_BYTES + 1 < numChunks)
+		numChunks = (end - start) / MIN_CHUNK_BYTES + 1;
+		
+	chunks = (ParseChunk *) calloc(numChunks, sizeof(ParseChunk));
+	chunkStart = start;
+	
+	for(i = 0; i < numChunks; i++)
+	{
+		chunkEnd = end;
+		
+		if(i < numChunks - 1)
+		{
+			/* Move the split point forward to just past the next newline */
+			chunkEnd = start + (end - start) / numChunks * (i + 1);
+			
+			if(chunkEnd < chunkStart)
+				chunkEnd = chunkStart;
+			
+			chunkEnd = (char *) memchr(chunkEnd, '\n', end - chunkEnd);
+			chunkEnd = chunkEnd == NULL ? end : chunkEnd + 1;
+		}
+		
+		chunks[i].start = chunkStart;
+		chunks[i].end = chunkEnd;
+		chunkStart = chunkEnd;
+	}
+	
+	/* The calling thread takes the first chunk itself */
+	for(i = 1; i < numChunks; i++)
+		pthread_create(&chunks[i].thread, NULL, &parseChunkThread, &chunks[i]);
+		
+	parseChunkThread(&chunks[0]);
+	
+	for(i = 1; i < numChunks; i++)
+		pthread_join(chunks[i].thread, NULL);
+		
+	/* Chunks are consecutive, so going through them in turn keeps the input order */
+	numberLateNames(chunks, numChunks);
+	n = 0;
+	
+	for(i = 0; i < numChunks; i++)
+		n += chunks[i].numTransactions;
+		
+	transactionsList.transactions = (Transaction *) malloc((n > 0 ? n : 1) * sizeof(Transaction));
+	transactionsList.jobArrays = (Job **) malloc(numChunks * sizeof(Job *));
+	
+	for(i = 0; i < numChunks; i++)
+	{
+		for(j = 0; j < chunks[i].numTransactions; j++)
+		{
+			chunks[i].transactions[j].jobs = chunks[i].jobs + chunks[i].transactions[j].firstJob;
+			chunks[i].transactions[j].order = transactionsList.numTransactions;
+			chunks[i].transactions[j].jobBase = transactionsList.numJobs;
+			transactionsList.numJobs += chunks[i].transactions[j].numJobs;
+			transactionsList.transactions[transactionsList.numTransactions++] = chunks[i].transactions[j];
+		}
+		
+		transactionsList.jobArrays[transactionsList.numJobArrays++] = chunks[i].jobs;
+		free(chunks[i].transactions);
+	}
+	
+	free(chunks);
+}
+
+/* Read the whole input file into a NUL terminated buffer */
+char *readInputFile(const char *path, long *size)
+{
+	FILE *file;
+	char *buffer;
+	
+	file = fopen(path, "rb");
+	
+	if(file == NULL)
+		return NULL;
+		
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	buffer = (char *) malloc(*size + 1);
+	*size = fread(buffer, 1, *size, file);
+	buffer[*size] = '\0';
+	
+	fclose(file);
+	
+	return buffer;
+}
+
+/* Entry point of the program */
+int main(int argc, char *argv[])
+{
+	FILE *file;
+	FILE *deltaFile;
+	Transaction *transaction;
+	const char *inputPath;
+	const char *deltaPath;
+	const char *tracePath;
+	const char *replayPath;
+	char *storePath;
+	char *metricsPath;
+	char *separator;
+	char *buffer;
+	char *line;
+	char *lineEnd;
+	char *end;
+	long size;
+	BatchOperation batchOperations[MAX_BATCH_OPERATIONS];
+	double batchTimes[MAX_BATCH_OPERATIONS];
+	int numBatchOperations;
+	int numParseThreads;
+	int numWorkers;
+	int numShards;
+	int weights[NUM_CLASSES];
+	int showTimings;
+	int compactJobs;
+	int useReservations;
+	int useFastDeposits;
+	unsigned int numFuzzWithdrawals;
+	unsigned int fuzzSeed;
+	int option;
+	int i;
+	PerfPhase perfPhases[4];
+	int usePerfCounters;
+	double perAccount;
+	double lockBytes;
+	double recordBytes;
+	unsigned int cacheMegabytes;
+	unsigned int metricsPeriod;
+	double startTime;
+	double loadTime;
+	double parseTime;
+	double executeTime;
+	double reportTime;
+	double deltaTime;
+	double encodeTime;
+	double decodeTime;
+	unsigned int numChanged;
+	
+	inputPath = "assignment_3_input_file.txt";
+	deltaPath = NULL;
+	deltaFile = NULL;
+	tracePath = NULL;
+	replayPath = NULL;
+	storePath = NULL;
+	cacheMegabytes = 64;
+	metricsPath = NULL;
+	metricsPeriod = 1000;
+	numChanged = 0;
+	deltaTime = 0;
+	numParseThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	numWorkers = 0;
+	numShards = 0;
+	numBatchOperations = 0;
+	weights[CLASS_INTERACTIVE] = 8;
+	weights[CLASS_BULK] = 2;
+	weights[CLASS_MAINTENANCE] = 1;
+	showTimings = FALSE;
+	compactJobs = FALSE;
+	useReservations = FALSE;
+	useFastDeposits = FALSE;
+	numFuzzWithdrawals = 0;
+	fuzzSeed = 1;
+	encodeTime = 0;
+	decodeTime = 0;
+	usePerfCounters = FALSE;
+	memset(perfPhases, 0, sizeof(perfPhases));
+	
+	while((option = getopt(argc, argv, "qtPJADF:p:w:N:W:e:d:r:R:L:S:M:")) != -1)
+	{
+		if(option == 'q')
+			verbose = FALSE;
+		else if(option == 't')
+			showTimings = TRUE;
+		else if(option == 'P')
+			usePerfCounters = TRUE;
+		else if(option == 'J')
+			compactJobs = TRUE;
+		else if(option == 'A')
+			useReservations = TRUE;
+		else if(option == 'D')
+			useFastDeposits = TRUE;
+		else if(option == 'F')
 		{
-			/* Extract the transaction fee limit before fee can occur */
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &account->transactionFeeThreshold);
+			/* Number of withdrawals, optionally followed by the seed */
+			numFuzzWithdrawals = (unsigned int) atoi(optarg);
 			
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &account->transactionFee);
+			if(strchr(optarg, ':') != NULL)
+				fuzzSeed = (unsigned int) atoi(strchr(optarg, ':') + 1);
 		}
-		else if(strcmp(token, "overdraft") == 0)
+		else if(option == 'p')
+			numParseThreads = atoi(optarg);
+		else if(option == 'w')
+			numWorkers = atoi(optarg);
+		else if(option == 'N' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_SHARDS)
+			numShards = atoi(optarg);
+		else if(option == 'd')
+			deltaPath = optarg;
+		else if(option == 'r')
+			tracePath = optarg;
+		else if(option == 'R')
+			replayPath = optarg;
+		else if(option == 'S')
 		{
-			/* Extract and check if account is overdraft protected */
-			token = strtok(NULL, " ");
+			/* Store file, optionally followed by the cache size in MB */
+			storePath = optarg;
 			
-			if(strcmp(token, "Y") == 0)
+			if(strchr(storePath, ':') != NULL)
 			{
-				account->isOverdraftProtected = TRUE;
-				
-				token = strtok(NULL, " ");
-				sscanf(token, "%d", &account->overdraftFee);
+				cacheMegabytes = (unsigned int) atoi(strchr(storePath, ':') + 1);
+				*strchr(storePath, ':') = '\0';
 			}
-			else
+		}
+		else if(option == 'M')
+		{
+			/* Metrics file or unix:socket, optionally followed by the export period in ms */
+			metricsPath = optarg;
+			separator = strrchr(metricsPath, ':');
+			
+			if(separator != NULL && separator[1] != '\0' && strspn(separator + 1, "0123456789") == strlen(separator + 1))
 			{
-				account->isOverdraftProtected = FALSE;
+				metricsPeriod = (unsigned int) atoi(separator + 1);
+				*separator = '\0';
 			}
 		}
+		else if(option == 'L' && (strcmp(optarg, "pthread") == 0 || strcmp(optarg, "adaptive") == 0))
+			usePthreadLocks = strcmp(optarg, "pthread") == 0;
+		else if(option == 'W' && sscanf(optarg, "%d:%d:%d", &weights[0], &weights[1], &weights[2]) == 3)
+			continue;
+		else if(option == 'e' && (numBatchOperations = parseBatchOperations(optarg, batchOperations)) >= 0)
+			continue;
+		else
+		{
+			fprintf(stderr, "Usage: %s [-q] [-t] [-P] [-J] [-A] [-D] [-F withdrawals[:seed]] [-p parseThreads] [-w workers | -N shards] [-W interactive:bulk:maintenance]\n"
+				"       [-e fees,interest=basisPoints,reset,overdraft,withdraw=amount] [-d deltaFile] [-r traceFile | -R traceFile]\n"
+				"       [-L adaptive|pthread] [-S storeFile[:cacheMB]] [-M metricsFile|unix:socket[:periodMs]] [inputFile]\n"
+				"-S pages the balance, count, fee and flag columns only, IDs, names and locks stay in memory\n", argv[0]);
+			return 1;
+		}
+	}
+	
+	if(optind < argc)
+		inputPath = argv[optind];
 		
-		token = strtok(NULL, " ");
+	/* Traces number every job and look them up out of order, which the blocks can't do cheaply */
+	if(compactJobs && (tracePath != NULL || replayPath != NULL))
+	{
+		fprintf(stderr, "-J can't be used with -r or -R\n");
+		return 1;
 	}
 	
-	/* Add account to the list */
-	if(accountsList.numAccounts == 0)
+	/* Shards keep their accounts to themselves until the end, so nothing else may look at them on the way */
+	if(numShards > 0 && (numWorkers > 0 || tracePath != NULL || replayPath != NULL || deltaPath != NULL || storePath != NULL
+		|| useReservations || useFastDeposits || metricsPath != NULL))
 	{
-		accountsList.head = account;
-		accountsList.tail = account;
+		fprintf(stderr, "-N can't be used with -w, -r, -R, -d, -S, -A, -D or -M\n");
+		return 1;
 	}
-	else
+	
+	/* Reservations and lock-free deposits take no lock, so there is no lock order to record */
+	if((useReservations || useFastDeposits) && (tracePath != NULL || replayPath != NULL))
 	{
-		accountsList.tail->next = account;
-		accountsList.tail = account;
+		fprintf(stderr, "-A and -D can't be used with -r or -R\n");
+		return 1;
 	}
+		
+	if(numParseThreads < 1)
+		numParseThreads = 1;
 	
-	accountsList.numAccounts++;
-}
-
-/* Find the account object that holds the ID */
-Account *findAccount(char *id)
-{
-	Account *current;
+	accountsList.blocks = NULL;
+	accountsList.ids = NULL;
+	accountsList.locks = NULL;
+	accountsList.mutexes = NULL;
+	accountsList.numAccounts = 0;
+	accountsList.capacity = 0;
 	
-	current = accountsList.head;
+	stringPool.data = NULL;
+	stringPool.size = 0;
+	stringPool.capacity = 0;
 	
-	while(current != NULL)
-	{
-		if(strcmp(current->id, id) == 0)
-			return current;
-			
-		current = current->next;
-	}
+	feeSchedulesList.schedules = NULL;
+	feeSchedulesList.numSchedules = 0;
+	feeSchedulesList.capacity = 0;
 	
-	return NULL;
-}
-
-/* Delete all accounts */
-void deleteAccounts()
-{
-	Account *next;
-	Account *current;
+	transactionsList.transactions = NULL;
+	transactionsList.numTransactions = 0;
+	transactionsList.jobArrays = NULL;
+	transactionsList.numJobArrays = 0;
+	transactionsList.encodedJobs = NULL;
+	transactionsList.encodedSize = 0;
 	
-	next = NULL;
-	current = accountsList.head;
+	/* The fee kernel takes four lanes at a time where the processor can */
+#if defined(__x86_64__) || defined(__i386__)
+	useAvx2 = __builtin_cpu_supports("avx2");
+#endif
 	
-	while(current != NULL)
+	/* Check the fee kernel against withdrawFromAccount instead of running an input */
+	if(numFuzzWithdrawals > 0)
 	{
-		next = current->next;
-		free(current);
-		current = next;
+		i = fuzzWithdrawals(numFuzzWithdrawals, fuzzSeed) > 0;
+		deleteAccounts();
+		
+		return i;
 	}
-}
-
-/* Delete all jobs */
-void deleteJobs(Job *jobs)
-{
-	Job *next;
-	Job *current;
 	
-	next = NULL;
-	current = jobs;
+	/* Parse the input file and execute the commands */
+	buffer = readInputFile(inputPath, &size);
 	
-	while(current != NULL)
+	if(buffer == NULL)
 	{
-		next = current->next;
-		free(current);
-		current = next;
+		perror(inputPath);
+		return 1;
 	}
-}
-
-/* Delete all transactions */
-void deleteTransactions()
-{
-	Transaction *next;
-	Transaction *current;
 	
-	next = NULL;
-	current = transactionsList.transactions;
+	/* With a store file the account blocks live on disk behind a bounded cache */
+	pagedStore.enabled = FALSE;
 	
-	while(current != NULL)
+	if(storePath != NULL && !startPagedStore(storePath, cacheMegabytes))
 	{
-		next = current->next;
-		deleteJobs(current->jobsHead);
-		free(current);
-		current = next;
+		perror(storePath);
+		return 1;
 	}
-}
-
-/* Print all the accounts */
-void printAccounts(FILE *outFile)
-{
-	Account *current;
 	
-	current = accountsList.head;
+	/* The account section comes first and is loaded before anything else */
+	startTime = now();
+	line = buffer;
+	end = buffer + size;
 	
-	while(current != NULL)
+	while(line < end && line[0] == 'a')
 	{
-		fprintf(outFile, "%s type %s %d\n", 
-			current->id,
-			current->type,
-			current->balance);
-		current = current->next;
+		lineEnd = (char *) memchr(line, '\n', end - line);
+		
+		if(lineEnd == NULL)
+			lineEnd = end;
+			
+		*lineEnd = '\0';
+		addAccount(line);
+		line = lineEnd + 1;
 	}
-}
-
-/* Deposit an amount to an account, fees only apply for clients and not for depositors */
-void depositToAccount(Account *account, int amount, int applyFee)
-{
-	int fees;
 	
-	pthread_mutex_lock(&account->lock);
-
-	printf("Depositing $%d to account %s with starting balance of $%d\n", amount, account->id, account->balance);
-			
-	/* Calculate any added fees */
-	fees = 0;	
+	buildAccountIndex();
+	loadTime = now() - startTime;
 	
-	if(applyFee)
-	{
-		fees = account->depositFee;
-		printf("    Deposit fee of $%d\n", account->depositFee);
-	}
+	/* Counters are opened before any worker thread exists so every thread inherits them */
+	perfCounters.numOpen = 0;
 	
-	if(applyFee && account->numTransactions > account->transactionFeeThreshold)
-	{
-		printf("    Transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
-			account->transactionFee, account->numTransactions, account->transactionFeeThreshold);
-		fees += account->transactionFee;
-	}
+	for(i = 0; i < NUM_PERF_COUNTERS; i++)
+		perfCounters.fds[i] = -1;
+		
+	if(usePerfCounters)
+		startPerfCounters();
 	
-	account->balance += amount;
+	/* The rest of the file are independent client and depositor lines */
+	startTime = now();
+	beginPerfPhase(&perfPhases[0], "Parse");
 	
-	if(applyFee)
-		account->balance -= fees;
+	if(line < end)
+		parseTransactions(line, end, numParseThreads);
+		
+	/* Every name is known now, so is the number of accounts the jobs can open */
+	buildAccountDirectory();
+	reserveAccounts(directory.numOpenJobs);
+	reservations.enabled = useReservations && directory.numCloseJobs == 0;
 	
-	account->numTransactions++;	
-	printf("    Ending balance of $%d\n", account->balance);
-	printf("\n");
-
-	pthread_mutex_unlock(&account->lock);
-}
-
-/* Withdraw from account */
-void withdrawFromAccount(Account *account, int amount)
-{
-	int fees;
-	int num500s;
-
-	pthread_mutex_lock(&account->lock);
-
-	printf("Withdrawing $%d from account %s with starting balance of $%d\n", amount, account->id, account->balance);
-
-	/* Calculate any added fees */			
-	fees = account->withdrawalFee;
-	printf("    Withdrawal fee of $%d\n", account->withdrawalFee);
+	/* The narrative and the change list need each deposit's starting balance, which only
+	holds still under the lock */
+	pendingDeposits.enabled = useFastDeposits && !verbose && deltaPath == NULL && directory.numCloseJobs == 0;
+	
+	if(pendingDeposits.enabled)
+		pendingDeposits.words = (uint64_t *) calloc(accountsList.capacity > 0 ? accountsList.capacity : 1, sizeof(uint64_t));
+		
+	endPerfPhase(&perfPhases[0]);
+	parseTime = now() - startTime;
 	
-	if(account->numTransactions > account->transactionFeeThreshold)
+	/* Every account type is known now, a batch withdrawal has to fit with the fees of each */
+	for(i = 0; i < numBatchOperations; i++)
 	{
-		printf("    Transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
-			account->transactionFee, account->numTransactions, account->transactionFeeThreshold);
-		fees += account->transactionFee;	
+		if(batchOperations[i].operation == BATCH_WITHDRAWAL && !withdrawalFits(batchOperations[i].parameter))
+		{
+			fprintf(stderr, "-e withdraw=%" PRId64 " doesn't fit in an int with the fees of the account types\n", batchOperations[i].parameter);
+			return 1;
+		}
 	}
 	
-	/* Check balance... */
-	if(account->balance >= amount + fees)
-	{				
-		/* Safe side... there's enough balance to withdraw */
-		account->balance -= amount;
-		account->balance -= fees;
-		account->numTransactions++;				
-	}
-	else if(account->isOverdraftProtected)
+	/* Keep the jobs as compressed blocks, the engine decodes them as it runs */
+	if(compactJobs)
 	{
-		/* Negative balance side.. applicable only for overdraft protected accounts */
-		num500s = (amount / 500) + 1;
-		fees += num500s * account->overdraftFee;
+		startTime = now();
+		encodeJobs();
+		encodeTime = now() - startTime;
 		
-		printf("    Overdraft fee of $%d ($%d fee for every excess of $500)\n", num500s * account->overdraftFee, account->overdraftFee);
+		if(showTimings)
+			decodeTime = measureJobDecoding();
+	}
 	
-		/* Debt shouldn't go below -5000 */				
-		if(account->balance - fees - amount >= -5000)
-		{
-			account->balance -= amount;
-			account->balance -= fees;
-			account->numTransactions++;
-		}
-		else
+	/* Delta reports only list the accounts changed between checkpoints */
+	if(deltaPath != NULL)
+	{
+		deltaFile = fopen(deltaPath, "w");
+		
+		if(deltaFile == NULL)
 		{
-			printf("    Withdrawal rejected, amount (with fees) cannot continue \n");
-			printf("        because overdraft limit cannot go above $5000\n");
+			perror(deltaPath);
+			return 1;
 		}
+		
+		startDirtyTracking();
 	}
-	else
+	
+	/* Live counters for the run, exported while the jobs execute */
+	if(metricsPath != NULL && !startExporting(metricsPath, metricsPeriod,
+		numWorkers > 0 ? numWorkers : (replayPath != NULL ? 1 : (int) sysconf(_SC_NPROCESSORS_ONLN))))
 	{
-		printf("    Withdrawal rejected, amount (with fees) cannot continue \n");
-		printf("        because of insufficient balance and account not overdraft protected\n");
+		perror(metricsPath);
+		return 1;
 	}
 	
-	printf("    Ending balance of $%d\n", account->balance);	
-	printf("\n");
-
-	pthread_mutex_unlock(&account->lock);
-}
-
-/* Transfer a fund from one account to another */
-void transferFundsFromAndToAccount(Account *fromAccount, Account *toAccount, int amount)
-{
-	int senderFees;
-	int receiverFees;
-	int num500s;
-	
-	pthread_mutex_lock(&transferFundsLock);
-	pthread_mutex_lock(&fromAccount->lock);	
-	pthread_mutex_lock(&toAccount->lock);
-	
-	printf("Transferring $%d from %s to %s\n", amount, fromAccount->id, toAccount->id);
-	printf("    Account (Sender) %s has starting balance of $%d\n", fromAccount->id, fromAccount->balance);
-	printf("    Account (Receiver) %s has starting balance of $%d\n", toAccount->id, toAccount->balance);
-	
-	senderFees = fromAccount->transferFee;
-	receiverFees = toAccount->transferFee;
+	startTime = now();
+	beginPerfPhase(&perfPhases[1], "Execute");
 	
-	printf("    Account (Sender) %s has transfer fee of $%d\n", fromAccount->id, fromAccount->transferFee);
-	printf("    Account (Receiver) %s has transfer fee of $%d\n", toAccount->id, toAccount->transferFee);
+	if(tracePath != NULL)
+		startTracing();
+		
+	if(pagedStore.enabled)
+		startPrefetching();
 	
-	if(fromAccount->numTransactions > fromAccount->transactionFeeThreshold)
+	if(replayPath != NULL)
 	{
-		printf("    Account (Sender) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
-			fromAccount->id, fromAccount->transactionFee, 
-			fromAccount->numTransactions, fromAccount->transactionFeeThreshold);
-		senderFees += fromAccount->transactionFee;
+		/* Re-run a recorded lock order, on the -w threads or single-threaded */
+		if(!loadTrace(replayPath))
+		{
+			fprintf(stderr, "%s is not a trace of %s\n", replayPath, inputPath);
+			return 1;
+		}
+		
+		replayTrace(numWorkers);
 	}
-	
-	if(toAccount->numTransactions > toAccount->transactionFeeThreshold)
+	else if(numShards > 0)
 	{
-		printf("    Account (Receiver) %s has transaction fee of $%d, (made %d transactions out of %d transactions limit)\n", 
-			toAccount->id, toAccount->transactionFee, 
-			toAccount->numTransactions, toAccount->transactionFeeThreshold);
-		receiverFees += toAccount->transactionFee;
+		/* Run on shard processes, which fails if money was made or lost between them */
+		if(!runShards(numShards))
+			return 1;
 	}
-
-	/* Overdraft is not applicable for fund transfer, we assume that the account where to get money
-	has enough balance to transfer */		
-	if(fromAccount->balance >= amount + senderFees)
+	else if(numWorkers > 0)
 	{
-		/* Safe side no penalties */
-		fromAccount->balance -= amount;
-		fromAccount->balance -= senderFees;
-		fromAccount->numTransactions++;	
+		/* Run on the worker pool, where class weights take the place of the depositor gate */
+		startScheduler(numWorkers, weights);
 		
-		toAccount->balance += amount;
-		toAccount->balance -= receiverFees;
-		toAccount->numTransactions++;
-	}
-	else if(fromAccount->isOverdraftProtected)
-	{
-		/* Negative balance side.. applicable only for overdraft protected accounts */
-		num500s = (amount / 500) + 1;
-		senderFees += num500s * fromAccount->overdraftFee;
+		if(metricsPath != NULL)
+			__atomic_store_n(&metrics.watchQueues, TRUE, __ATOMIC_RELEASE);
 		
-		printf("    Account %s (Sender) has overdraft fee of $%d ($%d fee for every excess of $500)\n", 
-			fromAccount->id,
-			num500s * fromAccount->overdraftFee, fromAccount->overdraftFee);
-	
-		/* Debt shouldn't go below -5000 */				
-		if(fromAccount->balance - senderFees - amount >= -5000)
-		{
-			fromAccount->balance -= amount;
-			fromAccount->balance -= senderFees;
-			fromAccount->numTransactions++;
-		}
-		else
+		for(i = 0; i < transactionsList.numTransactions; i++)
 		{
-			printf("    Transfer rejected, amount (with fees) cannot continue \n");
-			printf("        because overdraft limit cannot go above $5000 for sender\n");
+			transaction = &transactionsList.transactions[i];
+			transaction->work.run = &transactionWork;
+			transaction->work.arg = transaction;
+			submitWork(&transaction->work, transactionClass(transaction));
 		}
+		
+		waitForScheduler();
 	}
 	else
 	{
-		printf("    Transfer rejected, amount (with fees) cannot continue \n");
-		printf("        because of insufficient balance of sender\n");
+		/* Depositors runs first than clients, make clients wait while a depositor is running */
+		for(i = 0; i < transactionsList.numTransactions; i++)
+		{
+			if(transactionsList.transactions[i].id[0] == 'd')
+				numDepositorsRunning++;
+		}
+		
+		/* Execute each transaction on another thread, in input order */
+		for(i = 0; i < transactionsList.numTransactions; i++)
+		{
+			transaction = &transactionsList.transactions[i];
+			pthread_create(&transaction->thread, NULL, &transactionThread, transaction);
+		}
+		
+		/* Wait for all transactions to finish */
+		for(i = 0; i < transactionsList.numTransactions; i++)
+			pthread_join(transactionsList.transactions[i].thread, NULL);
 	}
 	
-	printf("    Account %s has ending balance of $%d\n", fromAccount->id, fromAccount->balance);	
-	printf("    Account %s has ending balance of $%d\n", toAccount->id, toAccount->balance);
-	printf("\n");
-
-	pthread_mutex_unlock(&toAccount->lock);
-	pthread_mutex_unlock(&fromAccount->lock);
-	pthread_mutex_unlock(&transferFundsLock);
-}
-
-/* A method for each transaction thread, runs in parallel */
-void *transactionThread(void *args)
-{
-	Transaction *transaction;
-	Job *currentJob;
+	endPerfPhase(&perfPhases[1]);
+	executeTime = now() - startTime;
 	
-	/* Extract transaction information */
-	transaction = (Transaction *) args;
+	if(pagedStore.enabled)
+		stopPrefetching();
 	
-	if(transaction->id[0] == 'c')
-	{	
-		/* Clients have to wait for all depositors to finish before continuing */
-		pthread_mutex_lock(&clientsLock);
+	/* Deposits still sitting in the pending words go into the balances before anything reads them */
+	if(pendingDeposits.enabled)
+		foldAllDeposits();
 		
-		while(numDepositorsFinished < numDepositorsRunning)
-			pthread_cond_wait(&clientsWait, &clientsLock);		
+	if(metricsPath != NULL)
+		stopExporting();
+	
+	if(tracePath != NULL)
+	{
+		if(!writeTrace(tracePath))
+			perror(tracePath);
 			
-		pthread_cond_signal(&clientsWait);
-		pthread_mutex_unlock(&clientsLock);	
+		stopTracing();
 	}
 	
-	printf("%s thread is running...\n", transaction->id);
+	if(replayPath != NULL)
+	{
+		printCriticalPath(stderr);
+		stopReplay();
+	}
 	
-	/* Do all sequence of transaction */
-	currentJob = transaction->jobsHead;
+	if(deltaFile != NULL)
+	{
+		startTime = now();
+		numChanged += emitDeltaReport(deltaFile, "transactions");
+		deltaTime += now() - startTime;
+	}
 	
-	while(currentJob != NULL)
+	/* End of day maintenance, every transaction has finished so the accounts are quiet */
+	if(numBatchOperations > 0)
+		beginPerfPhase(&perfPhases[2], "Batch");
+		
+	for(i = 0; i < numBatchOperations; i++)
 	{
-		if(currentJob->type == 'd')
-		{
-			/* Perform a deposit on an account */			
-			printf("%s deposit $%d to account %s\n", transaction->id, currentJob->amount, currentJob->fromAccount->id);
-			
-			/* Fees apply only to clients and not to depositors */
-			if(transaction->id[0] == 'd')
-				depositToAccount(currentJob->fromAccount, currentJob->amount, FALSE);
-			else
-				depositToAccount(currentJob->fromAccount, currentJob->amount, TRUE);
-		}
-		else if(currentJob->type == 'w')
-		{
-			/* Peform a withdrawal on an account */			
-			printf("%s withdraw $%d from account %s\n", transaction->id, currentJob->amount, currentJob->fromAccount->id);
-			
-			withdrawFromAccount(currentJob->fromAccount, currentJob->amount);
-		}
-		else if(currentJob->type == 't')
+		startTime = now();
+		runBatchOperation(&batchOperations[i], (int) sysconf(_SC_NPROCESSORS_ONLN));
+		batchTimes[i] = now() - startTime;
+	}
+	
+	if(numBatchOperations > 0)
+		endPerfPhase(&perfPhases[2]);
+	
+	if(deltaFile != NULL)
+	{
+		if(numBatchOperations > 0)
 		{
-			/* Perform a fund transferfrom one account to another */			
-			printf("%s transfers $%d from account %s to account %s\n", transaction->id, 
-				currentJob->amount, currentJob->fromAccount->id, currentJob->toAccount->id);
-			
-			transferFundsFromAndToAccount(currentJob->fromAccount, currentJob->toAccount, currentJob->amount);
+			startTime = now();
+			numChanged += emitDeltaReport(deltaFile, "maintenance");
+			deltaTime += now() - startTime;
 		}
 		
-		currentJob = currentJob->next;		
+		fclose(deltaFile);
+		stopDirtyTracking();
 	}
 	
-	/* A depositor updates when it is done and signals clients if its ready for them to go */
-	if(transaction->id[0] == 'd')
+	/* Report results */
+	startTime = now();
+	beginPerfPhase(&perfPhases[3], "Report");
+	file = fopen("assignment_3_output_file.txt", "w");
+	
+	if(verbose)
 	{
-		numDepositorsFinished++;
-		pthread_cond_signal(&clientsWait);
-		pthread_mutex_unlock(&clientsLock);
+		printf("\nEnding Balances (Written to assignment_3_output_file.txt as well:\n");
+		printAccounts(stdout);
 	}
 	
-	printf("%s finished...\n", transaction->id);
-	
-	return (void *) NULL;
-}
-
-/* Create a transaction and add it to the list, each trasaction will have a list of job */
-Transaction *addTransaction(char *line)
-{
-	Transaction *transaction;
-	char *token;
-	Job *job;
+	printAccounts(file);
+	fclose(file);
 	
-	transaction = (Transaction *)malloc(sizeof(Transaction));
-	transaction->id[0] = '\0';
-	transaction->jobsHead = NULL;
-	transaction->jobsTail = NULL;
-	transaction->next= NULL;
+	if(pagedStore.enabled)
+		stopPagedStore();
 		
-	/* Extract the ID */
-	token = strtok(line, " ");
-	strcpy(transaction->id, token);
-	
-	/* Extract the jobs */
-	token = strtok(NULL, " ");
+	endPerfPhase(&perfPhases[3]);
+	reportTime = now() - startTime;
 	
-	while(token != NULL)
+	if(showTimings)
 	{
-		job = (Job *)malloc(sizeof(Job));
-		job->type = token[0];
-		job->fromAccount = NULL;
-		job->toAccount = NULL;
-		job->next = NULL;
+		perAccount = 1.0 / (accountsList.numAccounts > 0 ? accountsList.numAccounts : 1);
+		lockBytes = sizeof(AccountLock) + (usePthreadLocks ? sizeof(pthread_mutex_t) : 0);
+		recordBytes = storePath != NULL ? pagedStore.numFrames * sizeof(AccountBlock) * perAccount : (double) sizeof(AccountBlock) / ACCOUNTS_PER_BLOCK;
 		
-		if(job->type == 'd' || job->type == 'w')
+		if(recordBytes > (double) sizeof(AccountBlock) / ACCOUNTS_PER_BLOCK)
+			recordBytes = (double) sizeof(AccountBlock) / ACCOUNTS_PER_BLOCK;
+		
+		fprintf(stderr, "Load:    %10.3f ms  %u accounts, %u fee schedules\n", 
+			loadTime * 1e3, accountsList.numAccounts, feeSchedulesList.numSchedules);
+		fprintf(stderr, "Memory:  %10.1f bytes per account (record %.1f, ID %zu + %.1f text, lock %.0f, index %.1f)\n",
+			recordBytes + sizeof(unsigned int) + lockBytes
+				+ (stringPool.size + accountIndex.capacity * sizeof(unsigned int)) * perAccount,
+			recordBytes, sizeof(unsigned int), stringPool.size * perAccount,
+			lockBytes, accountIndex.capacity * sizeof(unsigned int) * perAccount);
+		fprintf(stderr, "Parse:   %10.3f ms  %d transactions, %u jobs, %.1f MB/s with %d threads\n", 
+			parseTime * 1e3, transactionsList.numTransactions, transactionsList.numJobs,
+			(end - line > 0 ? end - line : 0) / 1e6 / (parseTime > 0 ? parseTime : 1e-9), numParseThreads);
+		
+		if(compactJobs)
 		{
-			/* Create a deposit job */
-			token = strtok(NULL, " ");
-			job->fromAccount = findAccount(token);
-			
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &job->amount);
+			fprintf(stderr, "Encode:  %10.3f ms  %zu bytes, %.2f bytes per job, %.1fx smaller than jobs, %.1fx than text, decodes at %.1f M jobs/s\n",
+				encodeTime * 1e3, transactionsList.encodedSize,
+				(double) transactionsList.encodedSize / (transactionsList.numJobs > 0 ? transactionsList.numJobs : 1),
+				(double) transactionsList.numJobs * sizeof(Job) / (transactionsList.encodedSize > 0 ? transactionsList.encodedSize : 1),
+				(double) (end - line > 0 ? end - line : 0) / (transactionsList.encodedSize > 0 ? transactionsList.encodedSize : 1),
+				transactionsList.numJobs / 1e6 / (decodeTime > 0 ? decodeTime : 1e-9));
 		}
-		else if(job->type == 't')
-		{
-			/* Create a withdraw job */
-			token = strtok(NULL, " ");
-			job->fromAccount = findAccount(token);
+		
+		fprintf(stderr, "Execute: %10.3f ms\n", executeTime * 1e3);
+		
+		if(storePath != NULL)
+			printPagedStoreStats(stderr, executeTime);
 			
-			token = strtok(NULL, " ");
-			job->toAccount = findAccount(token);
+		if(numShards > 0)
+			printShardStats(stderr);
 			
-			token = strtok(NULL, " ");
-			sscanf(token, "%d", &job->amount);
-		}
-		
-		if(transaction->jobsHead == NULL)
+		if(reservations.enabled)
 		{
-			transaction->jobsHead = job;
-			transaction->jobsTail = job;
-		}
-		else
-		{
-			transaction->jobsTail->next = job;
-			transaction->jobsTail = job;
+			fprintf(stderr, "Reserve: %u rejected without a lock, %u released, %u retried\n",
+				reservations.numRejected, reservations.numReleased, reservations.numRetries);
 		}
+		else if(useReservations)
+			fprintf(stderr, "Reserve: not used, the input closes accounts\n");
+			
+		if(metricsPath != NULL)
+			fprintf(stderr, "Metrics: %u exports to %s\n", metrics.numExports, metrics.path);
+			
+		if(useFastDeposits && !pendingDeposits.enabled)
+			fprintf(stderr, "Deposit: -D not used, it needs -q, no -d and an input that closes no accounts\n");
 		
-		token = strtok(NULL, " ");
-	}
-	
-	/* Add the job to the list */
-	transaction->next = transactionsList.transactions;
-	transactionsList.transactions = transaction;
-	transactionsList.numTransactions++;
-	
-	return transaction;
-}
-
-/* Entry point of the program */
-int main()
-{
-	FILE *file;
-	Transaction *transaction;
-	char line[1024];
-	
-	accountsList.head = NULL;		
-	accountsList.tail = NULL;
-	accountsList.numAccounts = 0;
-	
-	transactionsList.transactions = NULL;
-	transactionsList.numTransactions = 0;
-	
-	/* Parse the input file and execute the commands */
-	file = fopen("assignment_3_input_file.txt", "r");
-	
-	while(fgets(line, 1024, file))
-	{
-		if(line[0] == 'a')
+		if(directory.numOpenJobs > 0 || directory.numCloseJobs > 0 || directory.numRejected > 0)
 		{
-			addAccount(line);
+			fprintf(stderr, "Directory: %u opened, %u closed, %u slots reused, %u jobs rejected, %u slots in use\n",
+				directory.numOpened, directory.numClosed, directory.numReused, directory.numRejected, accountsList.numAccounts);
 		}
-		else
+		
+		for(i = 0; i < numBatchOperations; i++)
 		{
-			/* Depositors runs first than clients, make clients wait while a depositor is running */			
-			if(line[0] == 'd')
-				numDepositorsRunning++;
-			
-			/* Execute a new transaction as a separate thread */
-			transaction = addTransaction(line);
-			
-			/* Execute transaction on another thread */
-			pthread_create(&transaction->thread, NULL, &transactionThread, transaction);
+			fprintf(stderr, "Batch:   %10.3f ms  %s, %.1f M accounts/s\n", batchTimes[i] * 1e3,
+				batchOperationName(&batchOperations[i]),
+				accountsList.numAccounts / 1e6 / (batchTimes[i] > 0 ? batchTimes[i] : 1e-9));
 		}
+		
+		fprintf(stderr, "Report:  %10.3f ms\n", reportTime * 1e3);
+		
+		if(deltaPath != NULL)
+			fprintf(stderr, "Delta:   %10.3f ms  %u changed accounts\n", deltaTime * 1e3, numChanged);
+		
+		if(scheduler.numWorkers > 0)
+			printSchedulerStats(stderr);
 	}
 	
-	fclose(file);
-	
-	/* Wait for all transactions to finish */
-	transaction = transactionsList.transactions;
-	
-	while(transaction != NULL)
+	if(usePerfCounters)
 	{
-		pthread_join(transaction->thread, NULL);
-		transaction = transaction->next;
+		printPerfPhases(stderr, perfPhases, 4, transactionsList.numJobs);
+		stopPerfCounters();
 	}
 	
-	/* Report results */
-	file = fopen("assignment_3_output_file.txt", "w");
-	
-	printf("\nEnding Balances (Written to assignment_3_output_file.txt as well:\n");
-	printAccounts(stdout);
-	printAccounts(file);
+	if(scheduler.numWorkers > 0)
+		stopScheduler();
 	
 	/* Clean up */
+	deleteMetrics();
 	deleteAccounts();
 	deleteTransactions();
+	free(buffer);
 	
 	return 0;
 }
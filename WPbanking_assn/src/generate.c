@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* The fee schedules handed out to generated accounts, picked round robin */
+const char *accountTypes[] =
+{
+	"type business d 2 w 2 t 3 transactions 20 1 overdraft Y 25",
+	"type personal d 0 w 1 t 1 transactions 10 2 overdraft N",
+	"type student d 0 w 0 t 0 transactions 5 1 overdraft N",
+	"type premium d 1 w 1 t 1 transactions 50 1 overdraft Y 10"
+};
+
+#define NUM_ACCOUNT_TYPES (sizeof(accountTypes) / sizeof(accountTypes[0]))
+
+/* Generator settings */
+long numAccounts = 1000;
+long numDepositors = 10;
+long numClients = 100;
+int jobsPerTransaction = 10;
+int numHotAccounts = 8;
+int hotPercent = 0;
+int openClosePercent = 0;
+
+/* Accounts opened by client jobs so far, they are numbered after the account section */
+long numOpened = 0;
+
+/* The account type names, the first word after "type" */
+const char *accountTypeNames[] = { "business", "personal", "student", "premium" };
+
+/* Pick an account, a hotPercent share of the picks go to the few hot accounts. Accounts
+opened by earlier jobs can be picked too */
+long pickAccount()
+{
+	if(hotPercent > 0 && rand() % 100 < hotPercent)
+		return rand() % (numHotAccounts < numAccounts ? numHotAccounts : numAccounts) + 1;
+
+	return (long) (((double) rand() / ((double) RAND_MAX + 1)) * (numAccounts + numOpened)) + 1;
+}
+
+/* Write a single depositor or client line */
+void writeTransaction(char prefix, long number)
+{
+	int i;
+	int kind;
+	long from;
+	long to;
+
+	printf("%c%ld", prefix, number);
+
+	for(i = 0; i < jobsPerTransaction; i++)
+	{
+		/* Depositors only deposit, clients mix deposits, withdrawals and transfers and
+		now and then open or close an account */
+		kind = prefix == 'd' ? 0 : rand() % 3;
+		from = pickAccount();
+
+		if(prefix == 'c' && openClosePercent > 0 && rand() % 100 < openClosePercent)
+		{
+			if(rand() % 2 == 0)
+			{
+				numOpened++;
+				printf(" o a%ld %s", numAccounts + numOpened, accountTypeNames[rand() % NUM_ACCOUNT_TYPES]);
+			}
+			else
+				printf(" x a%ld", from);
+		}
+		else if(kind == 0)
+			printf(" d a%ld %d", from, 100 + rand() % 5000);
+		else if(kind == 1)
+			printf(" w a%ld %d", from, 10 + rand() % 2000);
+		else
+		{
+			to = pickAccount();
+
+			if(to == from)
+				to = from % numAccounts + 1;
+
+			printf(" t a%ld a%ld %d", from, to, 10 + rand() % 1000);
+		}
+	}
+
+	printf("\n");
+}
+
+/* Writes a synthetic input file for asn3 to stdout */
+int main(int argc, char *argv[])
+{
+	int option;
+	long i;
+
+	srand(1);
+
+	while((option = getopt(argc, argv, "a:d:c:j:H:h:o:s:")) != -1)
+	{
+		if(option == 'a')
+			numAccounts = atol(optarg);
+		else if(option == 'd')
+			numDepositors = atol(optarg);
+		else if(option == 'c')
+			numClients = atol(optarg);
+		else if(option == 'j')
+			jobsPerTransaction = atoi(optarg);
+		else if(option == 'H')
+			numHotAccounts = atoi(optarg);
+		else if(option == 'h')
+			hotPercent = atoi(optarg);
+		else if(option == 'o')
+			openClosePercent = atoi(optarg);
+		else if(option == 's')
+			srand(atoi(optarg));
+		else
+		{
+			fprintf(stderr, "Usage: %s [-a accounts] [-d depositors] [-c clients] [-j jobsPerTransaction]\n"
+				"       [-H hotAccounts] [-h hotPercent] [-o openClosePercent] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(numAccounts < 1 || numHotAccounts < 1)
+	{
+		fprintf(stderr, "Need at least one account and one hot account\n");
+		return 1;
+	}
+
+	for(i = 1; i <= numAccounts; i++)
+		printf("a%ld %s\n", i, accountTypes[i % NUM_ACCOUNT_TYPES]);
+
+	/* Depositors and clients are interleaved the same way a live feed would be */
+	for(i = 1; i <= numDepositors || i <= numClients; i++)
+	{
+		if(i <= numDepositors)
+			writeTransaction('d', i);
+
+		if(i <= numClients)
+			writeTransaction('c', i);
+	}
+
+	return 0;
+}